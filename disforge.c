@@ -2,744 +2,3029 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include "disforge.h"
+
+/*
+ * Output sink
+ */
+
+static const char hex_digits[] = "0123456789abcdef";
+static const char hex_digits_upper[] = "0123456789ABCDEF";
+
+void disforge_sink_init(struct disforge_sink *out, int fd, char *buf, size_t cap)
+{
+    out->fd = fd;
+    out->buf = buf;
+    out->len = 0;
+    out->cap = cap;
+    out->error = 0;
+    out->format = DISFORGE_TEXT;
+    out->write = NULL;
+    out->user = NULL;
+    out->async = NULL;
+}
+
+// Set up a sink that passes its text to write(user, ...) instead of a file.
+void disforge_sink_init_fn(struct disforge_sink *out, char *buf, size_t cap,
+                           disforge_sink_write_fn write, void *user)
+{
+    disforge_sink_init(out, DISFORGE_SINK_CALLBACK, buf, cap);
+    out->write = write;
+    out->user = user;
+}
+
+// Set up a growable memory sink. Returns 0, or ENOMEM.
+int disforge_sink_init_mem(struct disforge_sink *out, size_t cap)
+{
+    if (cap < DISFORGE_SINK_MIN_CAP)
+        cap = DISFORGE_SINK_MIN_CAP;
+    disforge_sink_init(out, DISFORGE_SINK_MEMORY, malloc(cap), cap);
+    return out->buf ? 0 : ENOMEM;
+}
+
+void disforge_sink_free_mem(struct disforge_sink *out)
+{
+    free(out->buf);
+    out->buf = NULL;
+    out->cap = out->len = 0;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        data += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+/*
+ * Asynchronous output
+ *
+ * An asynchronous sink (disforge_sink_init_async()) splits its buffer into two
+ * halves. When the half being filled runs full it is submitted to the
+ * kernel as one io_uring writev and the listing carries on in the other
+ * half, so formatting overlaps the write. At most one write is in flight,
+ * which keeps the output in order. A half is reused only once its write
+ * has completed, and a short write is resubmitted for the rest.
+ *
+ * The ring is set up with raw syscalls. The sink needs
+ * IORING_FEAT_SINGLE_MMAP and IORING_FEAT_RW_CUR_POS: writes go to the
+ * file position, so pipes and files opened for appending work as well.
+ * Where io_uring is missing (an old kernel, a seccomp policy), or once a
+ * completion fails, the sink writes synchronously instead. It holds a full
+ * half back and writes it and the next half with a single writev(2); a
+ * lasting error then comes back from writev and is latched as usual.
+ */
+
+struct disforge_sink_async {
+    int          ring_fd;       // -1 once io_uring is unavailable
+    char        *half[2];
+    const char  *pending;       // full half waiting to be written (or being written)
+    size_t       pending_len;   // 0 if there is none
+    size_t       pending_done;  // bytes of it written so far
+    int          in_flight;     // a write of pending has been submitted
+    struct iovec iov;           // what the submitted write covers
+    unsigned    *sq_tail, *sq_mask, *sq_array;
+    unsigned    *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void        *ring_map;
+    size_t       ring_size;
+    size_t       sqes_size;
+};
+
+static int writev_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            count--;
+            continue;
+        }
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        for (; count > 0 && (size_t) n >= iov->iov_len; iov++, count--)
+            n -= (ssize_t) iov->iov_len;
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= (size_t) n;
+        }
+    }
+    return 0;
+}
+
+static void uring_close(struct disforge_sink_async *a)
+{
+    if (a->ring_fd < 0)
+        return;
+    munmap(a->sqes, a->sqes_size);
+    munmap(a->ring_map, a->ring_size);
+    close(a->ring_fd);
+    a->ring_fd = -1;
+    a->in_flight = 0;
+}
+
+// Set up a two-entry ring. Leaves ring_fd at -1 if that is not possible.
+static void uring_open(struct disforge_sink_async *a)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    a->ring_fd = (int) syscall(SYS_io_uring_setup, 2, &p);
+    if (a->ring_fd < 0) {
+        a->ring_fd = -1;
+        return;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(a->ring_fd);
+        a->ring_fd = -1;
+        return;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    a->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    a->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    a->ring_map = mmap(NULL, a->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       a->ring_fd, IORING_OFF_SQ_RING);
+    a->sqes = mmap(NULL, a->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   a->ring_fd, IORING_OFF_SQES);
+    if (a->ring_map == MAP_FAILED || a->sqes == MAP_FAILED) {
+        if (a->ring_map != MAP_FAILED)
+            munmap(a->ring_map, a->ring_size);
+        if (a->sqes != MAP_FAILED)
+            munmap(a->sqes, a->sqes_size);
+        close(a->ring_fd);
+        a->ring_fd = -1;
+        return;
+    }
+
+    char *ring = a->ring_map;
+    a->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    a->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    a->sq_array = (unsigned *)(ring + p.sq_off.array);
+    a->cq_head = (unsigned *)(ring + p.cq_off.head);
+    a->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    a->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    a->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+}
+
+// Submit the unwritten rest of the pending half. Falls back on failure.
+static void uring_submit(struct disforge_sink *out)
+{
+    struct disforge_sink_async *a = out->async;
+    unsigned tail = *a->sq_tail;
+    unsigned slot = tail & *a->sq_mask;
+    struct io_uring_sqe *sqe = &a->sqes[slot];
+
+    a->iov.iov_base = (void *)(a->pending + a->pending_done);
+    a->iov.iov_len = a->pending_len - a->pending_done;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = out->fd;
+    sqe->off = (uint64_t) -1;   // at the file position, advancing it
+    sqe->addr = (uintptr_t) &a->iov;
+    sqe->len = 1;
+    a->sq_array[slot] = slot;
+    __atomic_store_n(a->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    long rc;
+    while ((rc = syscall(SYS_io_uring_enter, a->ring_fd, 1, 0, 0, NULL, 0)) < 0 && errno == EINTR)
+        ;
+    if (rc == 1)
+        a->in_flight = 1;
+    else
+        uring_close(a);
+}
+
+// Wait until the pending half is written, or handed back to the synchronous path.
+static void async_complete(struct disforge_sink *out)
+{
+    struct disforge_sink_async *a = out->async;
+
+    while (a->in_flight) {
+        unsigned head = *a->cq_head;
+        if (head == __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(SYS_io_uring_enter, a->ring_fd, 0, 1, IORING_ENTER_GETEVENTS,
+                        NULL, 0) < 0 && errno != EINTR) {
+                // The write may or may not have happened; nothing can be trusted.
+                out->error = errno;
+                uring_close(a);
+                a->pending_len = a->pending_done = 0;
+            }
+            continue;
+        }
+        int res = a->cqes[head & *a->cq_mask].res;
+        __atomic_store_n(a->cq_head, head + 1, __ATOMIC_RELEASE);
+        a->in_flight = 0;
+        if (res <= 0) {
+            uring_close(a);
+            break;
+        }
+        a->pending_done += (size_t) res;
+        if (a->pending_done < a->pending_len)
+            uring_submit(out);
+    }
+    if (a->ring_fd >= 0 && a->pending_done == a->pending_len)
+        a->pending_len = a->pending_done = 0;
+}
+
+// Write the rest of the pending half and the current buffer with one writev(2).
+static void async_drain(struct disforge_sink *out)
+{
+    struct disforge_sink_async *a = out->async;
+    struct iovec iov[2] = {
+        { (void *)(a->pending + a->pending_done), a->pending_len - a->pending_done },
+        { out->buf, out->len },
+    };
+
+    if (!out->error)
+        out->error = writev_all(out->fd, iov, 2);
+    a->pending_len = a->pending_done = 0;
+    out->len = 0;
+}
+
+// The buffer is full: pass it on and continue in the other half.
+static void async_spill(struct disforge_sink *out)
+{
+    struct disforge_sink_async *a = out->async;
+
+    async_complete(out);
+    if (out->error) {
+        a->pending_len = a->pending_done = 0;
+        out->len = 0;
+        return;
+    }
+    if (a->pending_len > 0) {
+        async_drain(out);
+        return;
+    }
+    if (out->len == 0)
+        return;
+    a->pending = out->buf;
+    a->pending_len = out->len;
+    a->pending_done = 0;
+    out->buf = out->buf == a->half[0] ? a->half[1] : a->half[0];
+    out->len = 0;
+    if (a->ring_fd >= 0)
+        uring_submit(out);
+}
+
+/*
+ * disforge_sink_init_async() sets up an asynchronous file sink over buf,
+ * which is split into two halves of cap / 2 bytes. Returns 0, or ENOMEM, in
+ * which case the sink writes synchronously. Release it with
+ * disforge_sink_free_async() after the last disforge_sink_flush().
+ */
+int disforge_sink_init_async(struct disforge_sink *out, int fd, char *buf, size_t cap)
+{
+    struct disforge_sink_async *a = calloc(1, sizeof(*a));
+
+    disforge_sink_init(out, fd, buf, cap / 2);
+    if (!a)
+        return ENOMEM;
+    a->half[0] = buf;
+    a->half[1] = buf + cap / 2;
+    uring_open(a);
+    out->async = a;
+    return 0;
+}
+
+// Whether an asynchronous sink is still writing through io_uring.
+int disforge_sink_async_active(const struct disforge_sink *out)
+{
+    return out->async && out->async->ring_fd >= 0;
+}
+
+/*
+ * disforge_sink_reopen() points a flushed file sink at fd and clears its
+ * error. An asynchronous sink keeps its ring, so one sink can write file
+ * after file without setting io_uring up for each; a ring that has failed
+ * stays closed, and the sink goes on writing synchronously.
+ */
+void disforge_sink_reopen(struct disforge_sink *out, int fd)
+{
+    out->fd = fd;
+    out->len = 0;
+    out->error = 0;
+    if (out->async) {
+        out->async->pending_len = out->async->pending_done = 0;
+        out->buf = out->async->half[0];
+    }
+}
+
+void disforge_sink_free_async(struct disforge_sink *out)
+{
+    if (!out->async)
+        return;
+    async_complete(out);
+    uring_close(out->async);
+    free(out->async);
+    out->async = NULL;
+}
+
+// Hand data to the sink's file or write callback. Returns 0 or an errno value.
+static int sink_emit(struct disforge_sink *out, const char *data, size_t len)
+{
+    if (out->fd == DISFORGE_SINK_CALLBACK)
+        return out->write(out->user, data, len);
+    return write_all(out->fd, data, len);
+}
+
+/*
+ * Write out everything buffered so far. Returns 0 or the latched errno.
+ * Memory sinks keep their contents.
+ */
+int disforge_sink_flush(struct disforge_sink *out)
+{
+    if (out->fd == DISFORGE_SINK_MEMORY)
+        return out->error;
+    if (out->async) {
+        async_complete(out);
+        async_drain(out);
+        return out->error;
+    }
+    if (out->len > 0 && !out->error)
+        out->error = sink_emit(out, out->buf, out->len);
+    out->len = 0;
+    return out->error;
+}
+
+/*
+ * Make room for n more bytes. Returns 0 if they now fit in the buffer, or
+ * -1 if n is larger than a file sink's whole buffer. A memory sink that
+ * cannot grow latches ENOMEM and drops its contents.
+ */
+int disforge_sink_make_room(struct disforge_sink *out, size_t n)
+{
+    if (out->fd != DISFORGE_SINK_MEMORY) {
+        if (out->async)
+            async_spill(out);
+        else
+            disforge_sink_flush(out);
+        return n <= out->cap ? 0 : -1;
+    }
+    size_t cap = out->cap * 2;
+    while (cap < out->len + n)
+        cap *= 2;
+    char *buf = realloc(out->buf, cap);
+    if (!buf) {
+        out->error = ENOMEM;
+        out->len = 0;
+        return n <= out->cap ? 0 : -1;
+    }
+    out->buf = buf;
+    out->cap = cap;
+    return 0;
+}
+
+// The part of disforge_sink_write() that does not fit even an empty buffer.
+void disforge_sink_write_through(struct disforge_sink *out, const char *s, size_t n)
+{
+    if (out->async)
+        disforge_sink_flush(out);
+    if (!out->error && out->fd != DISFORGE_SINK_MEMORY)
+        out->error = sink_emit(out, s, n);
+}
+
+/*
+ * Write value as lowercase hex (no 0x prefix), zero-padded to at least
+ * min_digits, to p. Returns the number of characters written (at most 16).
+ */
+static inline int hex_to_buf(char *p, uint64_t value, int min_digits)
+{
+    int n = value ? (64 - __builtin_clzll(value) + 3) / 4 : 1;
+    if (n < min_digits)
+        n = min_digits;
+    for (int k = n - 1; k >= 0; k--) {
+        p[k] = hex_digits[value & 0xF];
+        value >>= 4;
+    }
+    return n;
+}
+
+// Lowercase hex without a 0x prefix, zero-padded to at least min_digits.
+void disforge_sink_hex(struct disforge_sink *out, uint64_t value, int min_digits)
+{
+    char tmp[16];
+    disforge_sink_write(out, tmp, hex_to_buf(tmp, value, min_digits));
+}
+
+// A byte as two uppercase hex digits (used for raw opcode bytes).
+static void sink_hex_byte_upper(struct disforge_sink *out, uint8_t b)
+{
+    disforge_sink_putc(out, hex_digits_upper[b >> 4]);
+    disforge_sink_putc(out, hex_digits_upper[b & 0xF]);
+}
 
 // A static list of general–purpose register names.
-static const char *reg_names[] = {"EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"};
+static const char *const reg_names[] = {"EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"};
+static const uint8_t reg_name_len[] = {3, 3, 3, 3, 3, 3, 3, 3};
 
 // Print a register name (using only the low 3 bits)
-void print_reg(uint8_t reg) {
-    printf("%s", reg_names[reg & 0x7]);
+static void print_reg(struct disforge_sink *out, uint8_t reg) {
+    disforge_sink_write(out, reg_names[reg & 0x7], reg_name_len[reg & 0x7]);
 }
 
 // Print condition codes (using low 4 bits)
-void print_condition(uint8_t code) {
+static void print_condition(struct disforge_sink *out, uint8_t code) {
     const char* conditions[] = {"O", "NO", "B/NAE/C", "NB/AE/NC", "E/Z", "NE/NZ", "BE/NA", "NBE/A",
                                 "S", "NS", "P/PE", "NP/PO", "L/NGE", "NL/GE", "LE/NG", "NLE/G"};
-    printf("%s", conditions[code & 0xF]);
+    disforge_sink_puts(out, conditions[code & 0xF]);
+}
+
+static const char *const mnemonic_names[DISFORGE_MN_COUNT] = {
+    [DISFORGE_MN_INVALID] = "???",
+    [DISFORGE_MN_ADD] = "ADD", [DISFORGE_MN_OR] = "OR", [DISFORGE_MN_ADC] = "ADC",
+    [DISFORGE_MN_SBB] = "SBB", [DISFORGE_MN_AND] = "AND", [DISFORGE_MN_SUB] = "SUB",
+    [DISFORGE_MN_XOR] = "XOR", [DISFORGE_MN_CMP] = "CMP", [DISFORGE_MN_MOV] = "MOV",
+    [DISFORGE_MN_MOVZX] = "MOVZX", [DISFORGE_MN_MOVSX] = "MOVSX", [DISFORGE_MN_LEA] = "LEA",
+    [DISFORGE_MN_XCHG] = "XCHG", [DISFORGE_MN_TEST] = "TEST", [DISFORGE_MN_INC] = "INC",
+    [DISFORGE_MN_DEC] = "DEC", [DISFORGE_MN_PUSH] = "PUSH", [DISFORGE_MN_POP] = "POP",
+    [DISFORGE_MN_ROL] = "ROL", [DISFORGE_MN_ROR] = "ROR", [DISFORGE_MN_RCL] = "RCL",
+    [DISFORGE_MN_RCR] = "RCR", [DISFORGE_MN_SHL] = "SHL", [DISFORGE_MN_SHR] = "SHR",
+    [DISFORGE_MN_SAL] = "SAL", [DISFORGE_MN_SAR] = "SAR", [DISFORGE_MN_NOT] = "NOT",
+    [DISFORGE_MN_NEG] = "NEG", [DISFORGE_MN_MUL] = "MUL", [DISFORGE_MN_IMUL] = "IMUL",
+    [DISFORGE_MN_DIV] = "DIV", [DISFORGE_MN_IDIV] = "IDIV", [DISFORGE_MN_JCC] = "J",
+    [DISFORGE_MN_JMP] = "JMP", [DISFORGE_MN_CALL] = "CALL", [DISFORGE_MN_LOOPNZ] = "LOOPNZ",
+    [DISFORGE_MN_LOOPZ] = "LOOPZ", [DISFORGE_MN_LOOP] = "LOOP", [DISFORGE_MN_JECXZ] = "JECXZ",
+    [DISFORGE_MN_RET] = "RET", [DISFORGE_MN_NOP] = "NOP", [DISFORGE_MN_INT3] = "INT3",
+    [DISFORGE_MN_MOVSB] = "MOVSB", [DISFORGE_MN_MOVSD] = "MOVSD", [DISFORGE_MN_CMPSB] = "CMPSB",
+    [DISFORGE_MN_CMPSD] = "CMPSD", [DISFORGE_MN_STOSB] = "STOSB", [DISFORGE_MN_STOSD] = "STOSD",
+    [DISFORGE_MN_LODSB] = "LODSB", [DISFORGE_MN_LODSD] = "LODSD", [DISFORGE_MN_SCASB] = "SCASB",
+    [DISFORGE_MN_SCASD] = "SCASD", [DISFORGE_MN_LOCK] = "LOCK", [DISFORGE_MN_REPNZ] = "REPNZ",
+    [DISFORGE_MN_REP] = "REP",
+};
+
+// Name of a mnemonic id ("J" for DISFORGE_MN_JCC, printed with its condition).
+const char *disforge_mnemonic_name(unsigned mnemonic)
+{
+    return mnemonic_names[mnemonic < DISFORGE_MN_COUNT ? mnemonic : DISFORGE_MN_INVALID];
+}
+
+// Operand layouts an opcode can have.
+enum operand_form {
+    F_NONE,      // no operands
+    F_PREFIX,    // prefix byte, modifies the following opcode
+    F_OREG,      // register in the low opcode bits
+    F_OREG_IMM,  // register in the low opcode bits, immediate
+    F_ACC_IMM,   // EAX, immediate
+    F_RM,        // r/m
+    F_RM_REG,    // r/m, reg
+    F_REG_RM,    // reg, r/m
+    F_RM_IMM,    // r/m, immediate
+    F_RM_1,      // r/m, 1
+    F_RM_CL,     // r/m, CL
+    F_IMM,       // immediate
+    F_REL,       // relative branch displacement (imm_size bytes)
+};
+
+// Descriptor flags
+#define OPF_MODRM    0x01  // a ModR/M byte follows the opcode
+#define OPF_GROUP    0x02  // ModR/M reg field selects the entry; mnemonic holds the group id
+#define OPF_ESCAPE   0x04  // two-byte opcode, look up the next byte in opcode_table_0f
+#define OPF_BYTE_PTR 0x08  // r/m operand is printed with a BYTE PTR qualifier
+
+/*
+ * One entry per opcode byte. imm_size is the number of immediate (or
+ * relative displacement) bytes after the opcode and any ModR/M, SIB and
+ * displacement bytes.
+ */
+struct opcode_desc {
+    uint8_t mnemonic;
+    uint8_t form;
+    uint8_t imm_size;
+    uint8_t flags;
+};
+
+// ModR/M-selected opcode groups (the "/digit" opcodes)
+enum opcode_group {
+    GRP1_IB,   // 80, 83: ADD..CMP r/m, imm8
+    GRP1_ID,   // 81:     ADD..CMP r/m, imm32
+    GRP2_IB,   // C0, C1: shift/rotate r/m, imm8
+    GRP2_1,    // D0, D1: shift/rotate r/m, 1
+    GRP2_CL,   // D2, D3: shift/rotate r/m, CL
+    GRP3_B,    // F6:     TEST r/m, imm8 / NOT / NEG / MUL / IMUL / DIV / IDIV
+    GRP3_D,    // F7:     TEST r/m, imm32 / NOT / NEG / MUL / IMUL / DIV / IDIV
+    GRP5,      // FF:     INC / DEC / CALL / JMP r/m
+    GRP_COUNT
+};
+
+#define ARITH_ROW(op, mn) \
+    [(op) + 0] = {mn, F_RM_REG, 0, OPF_MODRM}, \
+    [(op) + 1] = {mn, F_RM_REG, 0, OPF_MODRM}, \
+    [(op) + 2] = {mn, F_REG_RM, 0, OPF_MODRM}, \
+    [(op) + 3] = {mn, F_REG_RM, 0, OPF_MODRM}, \
+    [(op) + 4] = {mn, F_ACC_IMM, 1, 0},        \
+    [(op) + 5] = {mn, F_ACC_IMM, 4, 0}
+
+#define GROUP(grp, form, imm) {grp, form, imm, OPF_MODRM | OPF_GROUP}
+
+// Single-byte opcodes. Entries left zeroed decode as DISFORGE_MN_INVALID.
+static const struct opcode_desc opcode_table[256] = {
+    ARITH_ROW(0x00, DISFORGE_MN_ADD), ARITH_ROW(0x08, DISFORGE_MN_OR),
+    ARITH_ROW(0x10, DISFORGE_MN_ADC), ARITH_ROW(0x18, DISFORGE_MN_SBB),
+    ARITH_ROW(0x20, DISFORGE_MN_AND), ARITH_ROW(0x28, DISFORGE_MN_SUB),
+    ARITH_ROW(0x30, DISFORGE_MN_XOR), ARITH_ROW(0x38, DISFORGE_MN_CMP),
+    [0x0F]          = {DISFORGE_MN_INVALID, F_NONE, 0, OPF_ESCAPE},
+
+    [0x40 ... 0x47] = {DISFORGE_MN_INC, F_OREG, 0, 0},
+    [0x48 ... 0x4F] = {DISFORGE_MN_DEC, F_OREG, 0, 0},
+    [0x50 ... 0x57] = {DISFORGE_MN_PUSH, F_OREG, 0, 0},
+    [0x58 ... 0x5F] = {DISFORGE_MN_POP, F_OREG, 0, 0},
+    [0x68]          = {DISFORGE_MN_PUSH, F_IMM, 4, 0},
+    [0x6A]          = {DISFORGE_MN_PUSH, F_IMM, 1, 0},
+    [0x70 ... 0x7F] = {DISFORGE_MN_JCC, F_REL, 1, 0},
+
+    [0x80]          = GROUP(GRP1_IB, F_RM_IMM, 1),
+    [0x81]          = GROUP(GRP1_ID, F_RM_IMM, 4),
+    [0x83]          = GROUP(GRP1_IB, F_RM_IMM, 1),
+    [0x84 ... 0x85] = {DISFORGE_MN_TEST, F_RM_REG, 0, OPF_MODRM},
+    [0x86 ... 0x87] = {DISFORGE_MN_XCHG, F_RM_REG, 0, OPF_MODRM},
+    [0x88 ... 0x89] = {DISFORGE_MN_MOV, F_RM_REG, 0, OPF_MODRM},
+    [0x8A ... 0x8B] = {DISFORGE_MN_MOV, F_REG_RM, 0, OPF_MODRM},
+    [0x8D]          = {DISFORGE_MN_LEA, F_REG_RM, 0, OPF_MODRM},
+    [0x90]          = {DISFORGE_MN_NOP, F_NONE, 0, 0},
+
+    [0xA4] = {DISFORGE_MN_MOVSB, F_NONE, 0, 0}, [0xA5] = {DISFORGE_MN_MOVSD, F_NONE, 0, 0},
+    [0xA6] = {DISFORGE_MN_CMPSB, F_NONE, 0, 0}, [0xA7] = {DISFORGE_MN_CMPSD, F_NONE, 0, 0},
+    [0xAA] = {DISFORGE_MN_STOSB, F_NONE, 0, 0}, [0xAB] = {DISFORGE_MN_STOSD, F_NONE, 0, 0},
+    [0xAC] = {DISFORGE_MN_LODSB, F_NONE, 0, 0}, [0xAD] = {DISFORGE_MN_LODSD, F_NONE, 0, 0},
+    [0xAE] = {DISFORGE_MN_SCASB, F_NONE, 0, 0}, [0xAF] = {DISFORGE_MN_SCASD, F_NONE, 0, 0},
+
+    [0xB0 ... 0xB7] = {DISFORGE_MN_MOV, F_OREG_IMM, 1, 0},
+    [0xB8 ... 0xBF] = {DISFORGE_MN_MOV, F_OREG_IMM, 4, 0},
+    [0xC0 ... 0xC1] = GROUP(GRP2_IB, F_RM_IMM, 1),
+    [0xC3]          = {DISFORGE_MN_RET, F_NONE, 0, 0},
+    [0xC6]          = {DISFORGE_MN_MOV, F_RM_IMM, 1, OPF_MODRM},
+    [0xC7]          = {DISFORGE_MN_MOV, F_RM_IMM, 4, OPF_MODRM},
+    [0xCC]          = {DISFORGE_MN_INT3, F_NONE, 0, 0},
+    [0xD0 ... 0xD1] = GROUP(GRP2_1, F_RM_1, 0),
+    [0xD2 ... 0xD3] = GROUP(GRP2_CL, F_RM_CL, 0),
+
+    [0xE0]          = {DISFORGE_MN_LOOPNZ, F_REL, 1, 0},
+    [0xE1]          = {DISFORGE_MN_LOOPZ, F_REL, 1, 0},
+    [0xE2]          = {DISFORGE_MN_LOOP, F_REL, 1, 0},
+    [0xE3]          = {DISFORGE_MN_JECXZ, F_REL, 1, 0},
+    [0xE8]          = {DISFORGE_MN_CALL, F_REL, 4, 0},
+    [0xE9]          = {DISFORGE_MN_JMP, F_REL, 4, 0},
+    [0xEB]          = {DISFORGE_MN_JMP, F_REL, 1, 0},
+
+    [0xF0]          = {DISFORGE_MN_LOCK, F_PREFIX, 0, 0},
+    [0xF2]          = {DISFORGE_MN_REPNZ, F_PREFIX, 0, 0},
+    [0xF3]          = {DISFORGE_MN_REP, F_PREFIX, 0, 0},
+    [0xF6]          = GROUP(GRP3_B, F_RM, 1),
+    [0xF7]          = GROUP(GRP3_D, F_RM, 4),
+    [0xFF]          = GROUP(GRP5, F_RM, 0),
+};
+
+// Two-byte opcodes (0x0F xx)
+static const struct opcode_desc opcode_table_0f[256] = {
+    [0xB6] = {DISFORGE_MN_MOVZX, F_REG_RM, 0, OPF_MODRM | OPF_BYTE_PTR},
+    [0xB7] = {DISFORGE_MN_MOVZX, F_REG_RM, 0, OPF_MODRM},
+    [0xBE] = {DISFORGE_MN_MOVSX, F_REG_RM, 0, OPF_MODRM | OPF_BYTE_PTR},
+    [0xBF] = {DISFORGE_MN_MOVSX, F_REG_RM, 0, OPF_MODRM},
+};
+
+#define SHIFT_GROUP(form, imm) {                                           \
+    {DISFORGE_MN_ROL, form, imm, OPF_MODRM}, {DISFORGE_MN_ROR, form, imm, OPF_MODRM},        \
+    {DISFORGE_MN_RCL, form, imm, OPF_MODRM}, {DISFORGE_MN_RCR, form, imm, OPF_MODRM},        \
+    {DISFORGE_MN_SHL, form, imm, OPF_MODRM}, {DISFORGE_MN_SHR, form, imm, OPF_MODRM},        \
+    {DISFORGE_MN_SAL, form, imm, OPF_MODRM}, {DISFORGE_MN_SAR, form, imm, OPF_MODRM} }
+
+#define ARITH_GROUP(imm) {                                                 \
+    {DISFORGE_MN_ADD, F_RM_IMM, imm, OPF_MODRM}, {DISFORGE_MN_OR, F_RM_IMM, imm, OPF_MODRM},   \
+    {DISFORGE_MN_ADC, F_RM_IMM, imm, OPF_MODRM}, {DISFORGE_MN_SBB, F_RM_IMM, imm, OPF_MODRM},  \
+    {DISFORGE_MN_AND, F_RM_IMM, imm, OPF_MODRM}, {DISFORGE_MN_SUB, F_RM_IMM, imm, OPF_MODRM},  \
+    {DISFORGE_MN_XOR, F_RM_IMM, imm, OPF_MODRM}, {DISFORGE_MN_CMP, F_RM_IMM, imm, OPF_MODRM} }
+
+#define UNARY_GROUP(imm) {                                                 \
+    {DISFORGE_MN_TEST, F_RM_IMM, imm, OPF_MODRM}, {DISFORGE_MN_TEST, F_RM_IMM, imm, OPF_MODRM}, \
+    {DISFORGE_MN_NOT, F_RM, 0, OPF_MODRM}, {DISFORGE_MN_NEG, F_RM, 0, OPF_MODRM},            \
+    {DISFORGE_MN_MUL, F_RM, 0, OPF_MODRM}, {DISFORGE_MN_IMUL, F_RM, 0, OPF_MODRM},           \
+    {DISFORGE_MN_DIV, F_RM, 0, OPF_MODRM}, {DISFORGE_MN_IDIV, F_RM, 0, OPF_MODRM} }
+
+// Group entries indexed by the ModR/M reg field. They replace the opcode's
+// own descriptor once the ModR/M byte is known.
+static const struct opcode_desc group_table[GRP_COUNT][8] = {
+    [GRP1_IB] = ARITH_GROUP(1),
+    [GRP1_ID] = ARITH_GROUP(4),
+    [GRP2_IB] = SHIFT_GROUP(F_RM_IMM, 1),
+    [GRP2_1]  = SHIFT_GROUP(F_RM_1, 0),
+    [GRP2_CL] = SHIFT_GROUP(F_RM_CL, 0),
+    [GRP3_B]  = UNARY_GROUP(1),
+    [GRP3_D]  = UNARY_GROUP(4),
+    [GRP5]    = {
+        {DISFORGE_MN_INC, F_RM, 0, OPF_MODRM}, {DISFORGE_MN_DEC, F_RM, 0, OPF_MODRM},
+        {DISFORGE_MN_CALL, F_RM, 0, OPF_MODRM}, {DISFORGE_MN_INVALID, F_RM, 0, OPF_MODRM},
+        {DISFORGE_MN_JMP, F_RM, 0, OPF_MODRM}, {DISFORGE_MN_INVALID, F_RM, 0, OPF_MODRM},
+        {DISFORGE_MN_INVALID, F_RM, 0, OPF_MODRM}, {DISFORGE_MN_INVALID, F_RM, 0, OPF_MODRM} },
+};
+
+// Operand kinds for each form; DISFORGE_OP_MEM stands for the r/m operand
+// and is narrowed to DISFORGE_OP_REG when mod == 3.
+static const uint8_t form_operands[][2] = {
+    [F_NONE]     = {DISFORGE_OP_NONE, DISFORGE_OP_NONE},
+    [F_PREFIX]   = {DISFORGE_OP_NONE, DISFORGE_OP_NONE},
+    [F_OREG]     = {DISFORGE_OP_REG, DISFORGE_OP_NONE},
+    [F_OREG_IMM] = {DISFORGE_OP_REG, DISFORGE_OP_IMM},
+    [F_ACC_IMM]  = {DISFORGE_OP_REG, DISFORGE_OP_IMM},
+    [F_RM]       = {DISFORGE_OP_MEM, DISFORGE_OP_NONE},
+    [F_RM_REG]   = {DISFORGE_OP_MEM, DISFORGE_OP_REG},
+    [F_REG_RM]   = {DISFORGE_OP_REG, DISFORGE_OP_MEM},
+    [F_RM_IMM]   = {DISFORGE_OP_MEM, DISFORGE_OP_IMM},
+    [F_RM_1]     = {DISFORGE_OP_MEM, DISFORGE_OP_ONE},
+    [F_RM_CL]    = {DISFORGE_OP_MEM, DISFORGE_OP_CL},
+    [F_IMM]      = {DISFORGE_OP_IMM, DISFORGE_OP_NONE},
+    [F_REL]      = {DISFORGE_OP_REL, DISFORGE_OP_NONE},
+};
+
+static inline uint32_t load_u32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
 /*
- * decode_rm_operand() decodes an operand given a ModR/M byte.
+ * decode_rm_operand() decodes the operand described by a ModR/M byte.
  *   modrm  - the ModR/M byte
  *   code   - the pointer to the machine code
  *   index  - the current index (just after the ModR/M byte)
  *   code_size - total available bytes
- *   buffer - where to write the operand string
- *   bufsize - size of buffer
+ *   insn   - receives base/index/scale/disp (or nothing for mod==3)
  *
- * Returns the new index after consuming any SIB/displacement bytes.
- *
- * For mod==3 the operand is simply a register;
- * otherwise the operand is printed as a memory reference (with a simple SIB/displacement decoder).
+ * Returns the new index after consuming any SIB/displacement bytes, or 0 if
+ * the buffer ends before they do.
  */
-size_t decode_rm_operand(uint8_t modrm, uint8_t *code, size_t index, size_t code_size,
-                           char *buffer, size_t bufsize)
+static size_t decode_rm_operand(uint8_t modrm, const uint8_t *code, size_t index,
+                                size_t code_size, struct disforge_insn *insn)
 {
-    int len = 0;
     uint8_t mod = modrm >> 6;
     uint8_t rm  = modrm & 0x7;
+    int no_base = 0;
 
-    if (mod == 3) {
-        // Register operand
-        len += snprintf(buffer + len, bufsize - len, "%s", reg_names[rm]);
+    insn->base = DISFORGE_REG_NONE;
+    insn->index = DISFORGE_REG_NONE;
+    insn->scale = 1;
+    if (mod == 3)
         return index;
-    }
 
-    // Memory operand – start with an opening bracket
-    len += snprintf(buffer + len, bufsize - len, "[");
     if (rm == 4) {
         // SIB byte present
-        if (index >= code_size) {
-            len += snprintf(buffer + len, bufsize - len, "incomplete SIB");
-            return index;
-        }
+        if (index >= code_size)
+            return 0;
         uint8_t sib = code[index++];
-        uint8_t scale = sib >> 6;
-        uint8_t index_reg = (sib >> 3) & 0x7;
         uint8_t base = sib & 0x7;
+        insn->flags |= DISFORGE_INSN_SIB;
+        insn->scale = 1 << (sib >> 6);
 
         // If mod == 0 and base == 5, then no base register (disp32 only)
-        if (!(mod == 0 && base == 5)) {
-            len += snprintf(buffer + len, bufsize - len, "%s", reg_names[base]);
-        }
-        // If the index field is not 4 (which means “none”), add index register
-        if (index_reg != 4) {
-            if (len > 0)
-                len += snprintf(buffer + len, bufsize - len, " + ");
-            len += snprintf(buffer + len, bufsize - len, "%s", reg_names[index_reg]);
-            if (scale > 0)
-                len += snprintf(buffer + len, bufsize - len, "*%d", 1 << scale);
-        }
-    } else {
-        // No SIB – simply print the register from the rm field.
-        len += snprintf(buffer + len, bufsize - len, "%s", reg_names[rm]);
+        no_base = (mod == 0 && base == 5);
+        if (!no_base)
+            insn->base = base;
+        // An index field of 4 means "no index"
+        if (((sib >> 3) & 0x7) != 4)
+            insn->index = (sib >> 3) & 0x7;
+    } else if (!(mod == 0 && rm == 5)) {
+        insn->base = rm;
     }
 
-    // Now check for any displacement bytes.
     if (mod == 1) {
         // disp8
-        if (index >= code_size) {
-            len += snprintf(buffer + len, bufsize - len, " + <incomplete disp8>");
-            return index;
-        }
-        int8_t disp = (int8_t) code[index++];
-        if (disp < 0)
-            len += snprintf(buffer + len, bufsize - len, " - 0x%x", -disp);
-        else
-            len += snprintf(buffer + len, bufsize - len, " + 0x%x", disp);
-    } else if (mod == 2 || (mod == 0 && rm == 5)) {
-        // disp32 (or mod==0, rm==5 means disp32 with no base)
-        if (index + 4 > code_size) {
-            len += snprintf(buffer + len, bufsize - len, " + <incomplete disp32>");
-            return index;
-        }
-        int32_t disp = *(int32_t*)&code[index];
+        if (index >= code_size)
+            return 0;
+        insn->disp = (int8_t) code[index++];
+        insn->flags |= DISFORGE_INSN_DISP;
+    } else if (mod == 2 || (mod == 0 && (rm == 5 || no_base))) {
+        // disp32 (or mod==0 with rm==5 or a SIB base of 5 means disp32 with no base)
+        if (index + 4 > code_size)
+            return 0;
+        insn->disp = (int32_t) load_u32(&code[index]);
         index += 4;
-        if (disp < 0)
-            len += snprintf(buffer + len, bufsize - len, " - 0x%x", -disp);
-        else
-            len += snprintf(buffer + len, bufsize - len, " + 0x%x", disp);
+        insn->flags |= DISFORGE_INSN_DISP;
     }
-    len += snprintf(buffer + len, bufsize - len, "]");
     return index;
 }
 
 /*
- * disassemble() reads the given machine code (of code_size bytes) and prints
- * a textual disassembly. For instructions that use a ModR/M byte the function
- * calls decode_rm_operand() to print memory–addressing.
+ * Instrumentation
+ *
+ * Building with -DDISFORGE_STATS counts every instruction decoded into a
+ * record: per opcode, unknown opcodes, truncations, the kind of r/m
+ * operand, and per mnemonic the number of rdtsc cycles spent decoding and
+ * formatting it. Counters are per thread and merged when a thread is done;
+ * the totals are printed to stderr at exit and, if DISFORGE_STATS_FILE
+ * names a file, also written there as tab-separated rows. Without the
+ * macro all of this compiles away.
  */
-void disassemble(uint8_t *code, size_t code_size) {
-    size_t i = 0;
-    while (i < code_size) {
-        printf("%04zx: ", i);
-        uint8_t opcode = code[i];
-
-        // For instructions that need to be followed by a ModR/M byte,
-        // we check that enough bytes remain.
-        switch (opcode) {
-            // MOV instructions with ModR/M (0x88-0x8B)
-            case 0x88: case 0x89: case 0x8A: case 0x8B: {
-                if (i + 1 >= code_size) {
-                    printf("Incomplete MOV instruction");
-                    return;
-                }
-                uint8_t modrm = code[i + 1];
-                size_t next = i + 2;
-                char operand_buf[64];
-                printf("MOV ");
-                if (opcode & 0x02) {
-                    // Direction = 1: destination = reg field; source = r/m operand.
-                    print_reg((modrm >> 3) & 0x7);
-                    printf(", ");
-                    next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                    printf("%s", operand_buf);
-                } else {
-                    // Direction = 0: destination = r/m operand; source = reg field.
-                    next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                    printf("%s, ", operand_buf);
-                    print_reg((modrm >> 3) & 0x7);
-                }
-                i = next;
-                break;
-            }
 
-            // MOV immediate (8-bit) to register: 0xB0 ... 0xB7
-            case 0xB0 ... 0xB7:
-                if (i + 1 >= code_size) {
-                    printf("Incomplete MOV imm8");
-                    return;
-                }
-                printf("MOV %s, 0x%02x", reg_names[opcode & 0x7], code[i + 1]);
-                i += 2;
-                break;
+#ifdef DISFORGE_STATS
+#include <x86intrin.h>
 
-            // MOV immediate (32-bit) to register: 0xB8 ... 0xBF
-            case 0xB8 ... 0xBF:
-                if (i + 4 >= code_size) {
-                    printf("Incomplete MOV imm32");
-                    return;
-                }
-                printf("MOV %s, 0x%08x", reg_names[opcode & 0x7],
-                       *(uint32_t*)&code[i + 1]);
-                i += 5;
-                break;
+struct disforge_stats {
+    uint64_t insns;
+    uint64_t truncated;
+    uint64_t unknown;
+    uint64_t prefixed;
+    uint64_t rm_reg;            // ModR/M r/m operand is a register
+    uint64_t rm_mem;            // memory operand without SIB
+    uint64_t rm_sib;            // memory operand with SIB
+    uint64_t opcode[256];
+    uint64_t opcode_0f[256];
+    uint64_t count[DISFORGE_MN_COUNT];
+    uint64_t decode_cycles[DISFORGE_MN_COUNT];
+    uint64_t formatted[DISFORGE_MN_COUNT];
+    uint64_t format_cycles[DISFORGE_MN_COUNT];
+};
 
-            // Arithmetic instructions (using ModR/M)
-            case 0x00 ... 0x05: case 0x08 ... 0x0D: case 0x10 ... 0x15:
-            case 0x18 ... 0x1D: case 0x20 ... 0x25: case 0x28 ... 0x2D:
-            case 0x30 ... 0x35: case 0x38 ... 0x3D: {
-                if (i + 1 >= code_size) {
-                    printf("Incomplete arithmetic instruction");
-                    return;
-                }
-                uint8_t modrm = code[i + 1];
-                size_t next = i + 2;
-                char operand_buf[64];
-                const char* ops[] = {"ADD", "OR", "ADC", "SBB", "AND", "SUB", "XOR", "CMP"};
-                printf("%s ", ops[(opcode >> 3) & 0x7]);
-                if (opcode & 0x02) {
-                    // destination = reg field; source = r/m operand.
-                    print_reg((modrm >> 3) & 0x7);
-                    printf(", ");
-                    next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                    printf("%s", operand_buf);
-                } else {
-                    // destination = r/m operand; source = reg field.
-                    next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                    printf("%s, ", operand_buf);
-                    print_reg((modrm >> 3) & 0x7);
-                }
-                i = next;
-                break;
-            }
+static __thread struct disforge_stats thread_stats;
+static struct disforge_stats total_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
-            // Immediate arithmetic (0x80, 0x81, 0x83)
-            case 0x80: case 0x81: case 0x83: {
-                if (i + 1 >= code_size) {
-                    printf("Incomplete immediate arithmetic");
-                    return;
-                }
-                uint8_t modrm = code[i + 1];
-                size_t next = i + 2;
-                char operand_buf[64];
-                const char* ops[] = {"ADD", "OR", "ADC", "SBB", "AND", "SUB", "XOR", "CMP"};
-                uint8_t op = (modrm >> 3) & 0x7;
-                printf("%s ", ops[op]);
-                next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                printf("%s, ", operand_buf);
-                if (opcode == 0x81) {
-                    if (next + 4 > code_size) {
-                        printf("Incomplete immediate");
-                        return;
-                    }
-                    uint32_t imm = *(uint32_t*)&code[next];
-                    next += 4;
-                    printf("0x%08x", imm);
-                } else {
-                    if (next >= code_size) {
-                        printf("Incomplete immediate");
-                        return;
-                    }
-                    uint8_t imm = code[next];
-                    next += 1;
-                    printf("0x%02x", imm);
-                }
-                i = next;
-                break;
-            }
+static void stats_record_decode(const struct disforge_insn *insn, size_t len, uint64_t cycles)
+{
+    struct disforge_stats *s = &thread_stats;
 
-            // INC/DEC (register–only instructions)
-            case 0x40 ... 0x47:
-                printf("INC %s", reg_names[opcode & 0x7]);
-                i++;
-                break;
-            case 0x48 ... 0x4F:
-                printf("DEC %s", reg_names[opcode & 0x7]);
-                i++;
-                break;
+    s->insns++;
+    if (len == 0) {
+        s->truncated++;
+        return;
+    }
+    if (insn->opcode == 0x0F)
+        s->opcode_0f[insn->opcode2]++;
+    else
+        s->opcode[insn->opcode]++;
+    if (insn->mnemonic == DISFORGE_MN_INVALID)
+        s->unknown++;
+    if (insn->prefixes)
+        s->prefixed++;
+    if (insn->flags & DISFORGE_INSN_MODRM) {
+        if ((insn->modrm >> 6) == 3)
+            s->rm_reg++;
+        else if (insn->flags & DISFORGE_INSN_SIB)
+            s->rm_sib++;
+        else
+            s->rm_mem++;
+    }
+    s->count[insn->mnemonic]++;
+    s->decode_cycles[insn->mnemonic] += cycles;
+}
 
-            // PUSH/POP (register instructions)
-            case 0x50 ... 0x57:
-                printf("PUSH %s", reg_names[opcode & 0x7]);
-                i++;
-                break;
-            case 0x58 ... 0x5F:
-                printf("POP %s", reg_names[opcode & 0x7]);
-                i++;
-                break;
+// Add the calling thread's counters to the totals and clear them.
+void disforge_stats_merge(void)
+{
+    const uint64_t *from = (const uint64_t *) &thread_stats;
+    uint64_t *to = (uint64_t *) &total_stats;
 
-            // PUSH immediate 32-bit and 8-bit
-            case 0x68:
-                if (i + 4 >= code_size) {
-                    printf("Incomplete PUSH imm32");
-                    return;
-                }
-                printf("PUSH 0x%08x", *(uint32_t*)&code[i + 1]);
-                i += 5;
-                break;
-            case 0x6A:
-                if (i + 1 >= code_size) {
-                    printf("Incomplete PUSH imm8");
-                    return;
-                }
-                printf("PUSH 0x%02x", code[i + 1]);
-                i += 2;
-                break;
+    pthread_mutex_lock(&stats_lock);
+    for (size_t n = 0; n < sizeof(total_stats) / sizeof(uint64_t); n++)
+        to[n] += from[n];
+    pthread_mutex_unlock(&stats_lock);
+    memset(&thread_stats, 0, sizeof(thread_stats));
+}
 
-            // MOV r/m8, imm8 and MOV r/m32, imm32
-            case 0xC6: {
-                if (i + 1 >= code_size) {
-                    printf("Incomplete MOV r/m8, imm8");
-                    return;
-                }
-                uint8_t modrm = code[i + 1];
-                size_t next = i + 2;
-                char operand_buf[64];
-                printf("MOV ");
-                next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                printf("%s, ", operand_buf);
-                if (next >= code_size) {
-                    printf("Incomplete immediate");
-                    return;
-                }
-                printf("0x%02x", code[next]);
-                next++;
-                i = next;
-                break;
-            }
-            case 0xC7: {
-                if (i + 1 >= code_size) {
-                    printf("Incomplete MOV r/m32, imm32");
-                    return;
-                }
-                uint8_t modrm = code[i + 1];
-                size_t next = i + 2;
-                char operand_buf[64];
-                printf("MOV ");
-                next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                printf("%s, ", operand_buf);
-                if (next + 4 > code_size) {
-                    printf("Incomplete immediate");
-                    return;
-                }
-                uint32_t imm = *(uint32_t*)&code[next];
-                next += 4;
-                printf("0x%08x", imm);
-                i = next;
-                break;
-            }
+static void stats_print_row(FILE *f, int tsv, const char *kind, const char *key,
+                            uint64_t count, uint64_t cycles, uint64_t formatted,
+                            uint64_t format_cycles)
+{
+    if (tsv) {
+        fprintf(f, "%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+                kind, key, count, cycles, formatted, format_cycles);
+    } else if (cycles || formatted) {
+        fprintf(f, "  %-10s %12" PRIu64 " %10.1f %10.1f\n", key, count,
+                count ? (double) cycles / count : 0.0,
+                formatted ? (double) format_cycles / formatted : 0.0);
+    } else {
+        fprintf(f, "  %-10s %12" PRIu64 "\n", key, count);
+    }
+}
 
-            // Conditional jump instructions (0x70 ... 0x7F)
-            case 0x70 ... 0x7F:
-                if (i + 1 >= code_size) {
-                    printf("Incomplete conditional jump");
-                    return;
-                }
-                printf("J");
-                print_condition(opcode);
-                printf(" 0x%02x", code[i + 1]);
-                i += 2;
-                break;
+// Write the totals as a table (tsv == 0) or as kind/key/count/cycles rows.
+static void stats_print(FILE *f, int tsv)
+{
+    const struct disforge_stats *s = &total_stats;
+    char key[16];
+    static const struct {
+        const char *name;
+        size_t offset;
+    } totals[] = {
+        {"insns", offsetof(struct disforge_stats, insns)},
+        {"truncated", offsetof(struct disforge_stats, truncated)},
+        {"unknown", offsetof(struct disforge_stats, unknown)},
+        {"prefixed", offsetof(struct disforge_stats, prefixed)},
+        {"rm_reg", offsetof(struct disforge_stats, rm_reg)},
+        {"rm_mem", offsetof(struct disforge_stats, rm_mem)},
+        {"rm_sib", offsetof(struct disforge_stats, rm_sib)},
+    };
 
-            // CALL rel32, JMP rel32, JMP rel8
-            case 0xE8:
-                if (i + 4 >= code_size) {
-                    printf("Incomplete CALL");
-                    return;
-                }
-                printf("CALL 0x%08" PRIxPTR, (size_t)(*(int32_t*)&code[i + 1] + i + 5));
-                i += 5;
-                break;
-            case 0xE9:
-                if (i + 4 >= code_size) {
-                    printf("Incomplete JMP");
-                    return;
-                }
-                printf("JMP 0x%08" PRIxPTR, (size_t)(*(int32_t*)&code[i + 1] + i + 5));
-                i += 5;
-                break;
-            case 0xEB:
-                if (i + 1 >= code_size) {
-                    printf("Incomplete JMP rel8");
-                    return;
-                }
-                printf("JMP 0x%02x", code[i + 1]);
-                i += 2;
-                break;
+    if (tsv)
+        fprintf(f, "kind\tkey\tcount\tdecode_cycles\tformatted\tformat_cycles\n");
+    else
+        fprintf(f, "\nDecoder statistics:\n");
+    for (size_t n = 0; n < sizeof(totals) / sizeof(totals[0]); n++)
+        stats_print_row(f, tsv, "total", totals[n].name,
+                        *(const uint64_t *)((const char *) s + totals[n].offset), 0, 0, 0);
 
-            // Other instructions
-            case 0x90:
-                printf("NOP");
-                i++;
-                break;
-            case 0xC3:
-                printf("RET");
-                i++;
-                break;
-            case 0xCC:
-                printf("INT3");
-                i++;
-                break;
+    if (!tsv)
+        fprintf(f, "\n  %-10s %12s %10s %10s\n", "class", "count", "dec cyc", "fmt cyc");
+    for (int m = 0; m < DISFORGE_MN_COUNT; m++)
+        if (s->count[m] || s->formatted[m])
+            stats_print_row(f, tsv, "mnemonic", mnemonic_names[m], s->count[m],
+                            s->decode_cycles[m], s->formatted[m], s->format_cycles[m]);
 
-            // LEA
-            case 0x8D: {
-                if (i + 1 >= code_size) {
-                    printf("Incomplete LEA");
-                    return;
-                }
-                uint8_t modrm = code[i + 1];
-                size_t next = i + 2;
-                char operand_buf[64];
-                printf("LEA ");
-                print_reg((modrm >> 3) & 0x7);
-                printf(", ");
-                next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                printf("%s", operand_buf);
-                i = next;
-                break;
-            }
+    if (!tsv)
+        fprintf(f, "\n  %-10s %12s\n", "opcode", "count");
+    for (int op = 0; op < 512; op++) {
+        uint64_t count = op < 256 ? s->opcode[op] : s->opcode_0f[op - 256];
+        if (count == 0)
+            continue;
+        snprintf(key, sizeof(key), op < 256 ? "%02X" : "0F %02X", op & 0xFF);
+        stats_print_row(f, tsv, "opcode", key, count, 0, 0, 0);
+    }
+}
 
-            // TEST
-            case 0x84: case 0x85: {
-                if (i + 1 >= code_size) {
-                    printf("Incomplete TEST");
-                    return;
-                }
-                uint8_t modrm = code[i + 1];
-                size_t next = i + 2;
-                char operand_buf[64];
-                printf("TEST ");
-                next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                printf("%s, ", operand_buf);
-                print_reg((modrm >> 3) & 0x7);
-                i = next;
-                break;
-            }
+// atexit() handler: merge the main thread's counters and report.
+void disforge_stats_report(void)
+{
+    const char *path = getenv("DISFORGE_STATS_FILE");
 
-            // XCHG
-            case 0x86: case 0x87: {
-                if (i + 1 >= code_size) {
-                    printf("Incomplete XCHG");
-                    return;
-                }
-                uint8_t modrm = code[i + 1];
-                size_t next = i + 2;
-                char operand_buf[64];
-                printf("XCHG ");
-                next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                printf("%s, ", operand_buf);
-                print_reg((modrm >> 3) & 0x7);
-                i = next;
-                break;
-            }
+    disforge_stats_merge();
+    stats_print(stderr, 0);
+    if (path) {
+        FILE *f = fopen(path, "w");
+        if (!f) {
+            perror("Error opening statistics file");
+            return;
+        }
+        stats_print(f, 1);
+        fclose(f);
+    }
+}
 
-            // Shift/Rotate instructions
-            case 0xC0: case 0xC1: case 0xD0: case 0xD1: case 0xD2: case 0xD3: {
-                if (i + 1 >= code_size) {
-                    printf("Incomplete shift/rotate");
-                    return;
-                }
-                uint8_t modrm = code[i + 1];
-                size_t next = i + 2;
-                char operand_buf[64];
-                const char* ops[] = {"ROL", "ROR", "RCL", "RCR", "SHL", "SHR", "SAL", "SAR"};
-                printf("%s ", ops[(modrm >> 3) & 0x7]);
-                next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                printf("%s, ", operand_buf);
-                if (opcode == 0xD2 || opcode == 0xD3) {
-                    printf("CL");
-                } else if (opcode == 0xC0 || opcode == 0xC1) {
-                    if (next >= code_size) {
-                        printf("Incomplete immediate");
-                        return;
-                    }
-                    printf("0x%02x", code[next]);
-                    next++;
-                } else {
-                    printf("1");
-                }
-                i = next;
-                break;
-            }
+#define STATS_TSC(t)        uint64_t t = __rdtsc()
+#define STATS_FORMAT(insn, t0) do {                                        \
+        thread_stats.formatted[(insn)->mnemonic]++;                        \
+        thread_stats.format_cycles[(insn)->mnemonic] += __rdtsc() - (t0);  \
+    } while (0)
+#define STATS_MERGE()       disforge_stats_merge()
+#else
+#define STATS_TSC(t)        ((void) 0)
+#define STATS_FORMAT(insn, t0) ((void) 0)
+#define STATS_MERGE()       ((void) 0)
+#endif
 
-            // MUL/IMUL/DIV/IDIV
-            case 0xF6: case 0xF7: {
-                if (i + 1 >= code_size) {
-                    printf("Incomplete MUL/IMUL/DIV/IDIV");
-                    return;
-                }
-                uint8_t modrm = code[i + 1];
-                size_t next = i + 2;
-                char operand_buf[64];
-                uint8_t reg_op = (modrm >> 3) & 0x7;
-                const char* ops[] = {"TEST", "TEST", "NOT", "NEG", "MUL", "IMUL", "DIV", "IDIV"};
-                printf("%s ", ops[reg_op]);
-                next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                printf("%s", operand_buf);
-                if (reg_op == 0 || reg_op == 1) {
-                    // TEST instructions use an immediate operand
-                    if (opcode == 0xF6) {
-                        if (next >= code_size) { printf(" <incomplete imm>"); return; }
-                        printf(", 0x%02x", code[next]);
-                        next++;
-                    } else {
-                        if (next + 4 > code_size) { printf(" <incomplete imm>"); return; }
-                        uint32_t imm = *(uint32_t*)&code[next];
-                        next += 4;
-                        printf(", 0x%08x", imm);
-                    }
-                }
-                i = next;
-                break;
-            }
+/*
+ * disforge_decode_at() decodes the instruction at the start of code, which
+ * is loaded at address, into *insn. Relative branch targets are resolved
+ * against address (modulo 2^32, as the CPU does in 32-bit mode). It never
+ * prints and never allocates, so it is safe to call from any thread.
+ *
+ * Returns the instruction length, or 0 if code_size bytes are not enough to
+ * hold the whole instruction. In that case insn->length is 0 and insn still
+ * records whatever was decoded (prefixes, opcode, and the mnemonic once it
+ * is known).
+ *
+ * decode_insn() is its body, inlined into disforge_decode_at() and into the
+ * loop of disforge_decode_batch(). Without operands, the op and op_reg
+ * fields are left 0: a batch that wants no operand array skips that pass.
+ */
+static inline __attribute__((always_inline))
+size_t decode_insn(const uint8_t *code, size_t code_size, size_t address,
+                   struct disforge_insn *insn, int operands)
+{
+    size_t i = 0;
 
-            // MOVZX/MOVSX (two–byte opcodes, 0x0F xx)
-            case 0x0F: {
-                if (i + 2 >= code_size) {
-                    printf("Incomplete 0F instruction");
-                    i++;
-                    break;
-                }
-                uint8_t second_byte = code[i + 1];
-                uint8_t modrm = code[i + 2];
-                size_t next = i + 3;
-                char operand_buf[64];
-                if (second_byte == 0xB6 || second_byte == 0xB7) {
-                    printf("MOVZX ");
-                    print_reg((modrm >> 3) & 0x7);
-                    printf(", ");
-                    if (second_byte == 0xB6)
-                        printf("BYTE PTR ");
-                    next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                    printf("%s", operand_buf);
-                } else if (second_byte == 0xBE || second_byte == 0xBF) {
-                    printf("MOVSX ");
-                    print_reg((modrm >> 3) & 0x7);
-                    printf(", ");
-                    if (second_byte == 0xBE)
-                        printf("BYTE PTR ");
-                    next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                    printf("%s", operand_buf);
-                } else {
-                    printf("Unknown 0F instruction");
-                    next = i + 2;
-                }
-                i = next;
-                break;
+    memset(insn, 0, sizeof(*insn));
+    insn->base = insn->index = DISFORGE_REG_NONE;
+    insn->scale = 1;
+    if (code_size == 0)
+        return 0;
+
+    const struct opcode_desc *d = &opcode_table[code[0]];
+    while (d->form == F_PREFIX) {
+        if (i + 1 >= DISFORGE_MAX_INSN_LEN)
+            goto invalid;
+        insn->prefixes |= 1 << (d->mnemonic - DISFORGE_MN_LOCK);
+        if (++i >= code_size)
+            return 0;
+        d = &opcode_table[code[i]];
+    }
+
+    insn->opcode = code[i++];
+    if (d->flags & OPF_ESCAPE) {
+        if (i >= code_size)
+            return 0;
+        insn->opcode2 = code[i++];
+        d = &opcode_table_0f[insn->opcode2];
+    }
+
+    if (d->flags & OPF_MODRM) {
+        if (!(d->flags & OPF_GROUP))
+            insn->mnemonic = d->mnemonic;
+        if (i >= code_size)
+            return 0;
+        insn->modrm = code[i++];
+        insn->flags |= DISFORGE_INSN_MODRM;
+        if (d->flags & OPF_GROUP)
+            d = &group_table[d->mnemonic][(insn->modrm >> 3) & 0x7];
+        insn->mnemonic = d->mnemonic;
+        i = decode_rm_operand(insn->modrm, code, i, code_size, insn);
+        if (i == 0)
+            return 0;
+    }
+    insn->mnemonic = d->mnemonic;
+
+    insn->imm_size = d->imm_size;
+    if (i + d->imm_size > code_size)
+        return 0;
+    if (d->imm_size == 4)
+        insn->imm = load_u32(&code[i]);
+    else if (d->imm_size == 1)
+        insn->imm = (d->form == F_REL) ? (uint32_t)(int8_t) code[i] : code[i];
+    i += d->imm_size;
+    if (i > DISFORGE_MAX_INSN_LEN)
+        goto invalid;
+
+    if (d->flags & OPF_BYTE_PTR)
+        insn->flags |= DISFORGE_INSN_BYTE_PTR;
+    if (d->mnemonic == DISFORGE_MN_JCC)
+        insn->cond = insn->opcode & 0xF;
+    if (d->form == F_REL)
+        insn->target = (uint32_t)(address + i + insn->imm);
+    if (operands && d->mnemonic != DISFORGE_MN_INVALID) {
+        for (int n = 0; n < 2; n++) {
+            uint8_t kind = form_operands[d->form][n];
+            if (kind == DISFORGE_OP_MEM && (insn->modrm >> 6) == 3) {
+                kind = DISFORGE_OP_REG;
+                insn->op_reg[n] = insn->modrm & 0x7;
+            } else if (kind == DISFORGE_OP_REG) {
+                if (d->form == F_OREG || d->form == F_OREG_IMM)
+                    insn->op_reg[n] = insn->opcode & 0x7;
+                else if (d->form != F_ACC_IMM)
+                    insn->op_reg[n] = (insn->modrm >> 3) & 0x7;
             }
+            insn->op[n] = kind;
+        }
+    }
+    insn->length = (uint8_t) i;
+    return i;
 
-            // CALL/JMP indirect (0xFF)
-            case 0xFF: {
-                if (i + 1 >= code_size) {
-                    printf("Incomplete FF instruction");
-                    return;
-                }
-                uint8_t modrm = code[i + 1];
-                size_t next = i + 2;
-                char operand_buf[64];
-                uint8_t reg_op = (modrm >> 3) & 0x7;
-                if (reg_op == 0) {
-                    printf("INC ");
-                    next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                    printf("%s", operand_buf);
-                } else if (reg_op == 1) {
-                    printf("DEC ");
-                    next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                    printf("%s", operand_buf);
-                } else if (reg_op == 2) {
-                    printf("CALL ");
-                    next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                    printf("%s", operand_buf);
-                } else if (reg_op == 4) {
-                    printf("JMP ");
-                    next = decode_rm_operand(modrm, code, next, code_size, operand_buf, sizeof(operand_buf));
-                    printf("%s", operand_buf);
-                } else {
-                    printf("Unknown FF instruction");
-                }
-                i = next;
+invalid:
+    // Longer than the CPU accepts: report the first byte on its own.
+    memset(insn, 0, sizeof(*insn));
+    insn->base = insn->index = DISFORGE_REG_NONE;
+    insn->scale = 1;
+    insn->opcode = code[0];
+    insn->length = 1;
+    return 1;
+}
+
+// decode_insn(), counted in DISFORGE_STATS builds.
+static inline __attribute__((always_inline))
+size_t decode_counted(const uint8_t *code, size_t code_size, size_t address,
+                      struct disforge_insn *insn, int operands)
+{
+#ifdef DISFORGE_STATS
+    uint64_t t0 = __rdtsc();
+    size_t len = decode_insn(code, code_size, address, insn, operands);
+    stats_record_decode(insn, len, __rdtsc() - t0);
+    return len;
+#else
+    return decode_insn(code, code_size, address, insn, operands);
+#endif
+}
+
+size_t disforge_decode_at(const uint8_t *code, size_t code_size, size_t address,
+                          struct disforge_insn *insn)
+{
+    return decode_counted(code, code_size, address, insn, 1);
+}
+
+static inline void insn_array_store(struct disforge_insn_array *a, size_t n,
+                                    const struct disforge_insn *insn, size_t address)
+{
+    if (a->address)
+        a->address[n] = address;
+    if (a->length)
+        a->length[n] = insn->length;
+    if (a->mnemonic)
+        a->mnemonic[n] = insn->mnemonic;
+    if (a->prefixes)
+        a->prefixes[n] = insn->prefixes;
+    if (a->flags)
+        a->flags[n] = insn->flags;
+    if (a->opcode)
+        a->opcode[n] = insn->opcode;
+    if (a->opcode2)
+        a->opcode2[n] = insn->opcode2;
+    if (a->modrm)
+        a->modrm[n] = insn->modrm;
+    for (int k = 0; k < 2; k++) {
+        if (a->op[k])
+            a->op[k][n] = insn->op[k];
+        if (a->op_reg[k])
+            a->op_reg[k][n] = insn->op_reg[k];
+    }
+    if (a->base)
+        a->base[n] = insn->base;
+    if (a->index)
+        a->index[n] = insn->index;
+    if (a->scale)
+        a->scale[n] = insn->scale;
+    if (a->cond)
+        a->cond[n] = insn->cond;
+    if (a->disp)
+        a->disp[n] = insn->disp;
+    if (a->imm)
+        a->imm[n] = insn->imm;
+    if (a->target)
+        a->target[n] = insn->target;
+}
+
+/*
+ * disforge_decode_batch() decodes up to max consecutive instructions from
+ * code, loaded at base, into the arrays of insns and sets insns->count.
+ * Returns the number of bytes consumed; decoding stops early at an
+ * instruction truncated by the end of code, which is left unconsumed so
+ * that the next call can pass it again with more bytes.
+ *
+ * Instructions are decoded in runs of DECODE_RUN into a local buffer, and
+ * each requested array is then filled from the run in a loop of its own:
+ * the NULL tests are paid once per run rather than once per instruction.
+ */
+#define DECODE_RUN 64
+
+// Fill elements n to n + k - 1 of array, if wanted, from run element j.
+#define STORE_COLUMN(array, value) do {                                    \
+        if (array)                                                          \
+            for (size_t j = 0; j < k; j++)                                  \
+                (array)[n + j] = (value);                                   \
+    } while (0)
+
+size_t disforge_decode_batch(const uint8_t *code, size_t code_size, size_t base,
+                             struct disforge_insn_array *insns, size_t max)
+{
+    // A local copy of the array pointers: stores through the uint8_t arrays
+    // may alias *insns, which would force every pointer to be reloaded.
+    struct disforge_insn_array a = *insns;
+    int operands = a.op[0] || a.op[1] || a.op_reg[0] || a.op_reg[1];
+    struct disforge_insn run[DECODE_RUN];
+    size_t i = 0, n = 0;
+
+    while (n < max && i < code_size) {
+        size_t k = 0, start = i, want = max - n < DECODE_RUN ? max - n : DECODE_RUN;
+        while (k < want && i < code_size) {
+            size_t len = decode_counted(code + i, code_size - i, base + i, &run[k], operands);
+            if (len == 0)
                 break;
+            k++;
+            i += len;
+        }
+        if (a.address) {
+            for (size_t j = 0; j < k; j++) {
+                a.address[n + j] = base + start;
+                start += run[j].length;
             }
+        }
+        STORE_COLUMN(a.length, run[j].length);
+        STORE_COLUMN(a.mnemonic, run[j].mnemonic);
+        STORE_COLUMN(a.prefixes, run[j].prefixes);
+        STORE_COLUMN(a.flags, run[j].flags);
+        STORE_COLUMN(a.opcode, run[j].opcode);
+        STORE_COLUMN(a.opcode2, run[j].opcode2);
+        STORE_COLUMN(a.modrm, run[j].modrm);
+        for (int op = 0; op < 2; op++) {
+            STORE_COLUMN(a.op[op], run[j].op[op]);
+            STORE_COLUMN(a.op_reg[op], run[j].op_reg[op]);
+        }
+        STORE_COLUMN(a.base, run[j].base);
+        STORE_COLUMN(a.index, run[j].index);
+        STORE_COLUMN(a.scale, run[j].scale);
+        STORE_COLUMN(a.cond, run[j].cond);
+        STORE_COLUMN(a.disp, run[j].disp);
+        STORE_COLUMN(a.imm, run[j].imm);
+        STORE_COLUMN(a.target, run[j].target);
+        n += k;
+        if (k < want)
+            break;   // end of code, or a truncated instruction
+    }
+    insns->count = n;
+    return i;
+}
 
-            // LOOP instructions
-            case 0xE0:
-                if (i + 1 >= code_size) {
-                    printf("Incomplete LOOPNZ");
-                    return;
-                }
-                printf("LOOPNZ 0x%02x", code[i + 1]);
-                i += 2;
-                break;
-            case 0xE1:
-                if (i + 1 >= code_size) {
-                    printf("Incomplete LOOPZ");
-                    return;
-                }
-                printf("LOOPZ 0x%02x", code[i + 1]);
-                i += 2;
-                break;
-            case 0xE2:
-                if (i + 1 >= code_size) {
-                    printf("Incomplete LOOP");
-                    return;
-                }
-                printf("LOOP 0x%02x", (uint8_t)(i + 2 + (int8_t)code[i + 1]));
-                i += 2;
-                break;
-            case 0xE3:
-                if (i + 1 >= code_size) {
-                    printf("Incomplete JECXZ");
-                    return;
-                }
-                printf("JECXZ 0x%02x", code[i + 1]);
-                i += 2;
-                break;
+/*
+ * disforge_walk() decodes code, loaded at ctx->base, from its first byte
+ * and calls ctx->insn_fn for every instruction. Returns the offset where
+ * the walk ended: code_size, the start of an instruction truncated by the
+ * end of code (which is not passed on), or the end of the instruction
+ * whose callback returned nonzero.
+ */
+size_t disforge_walk(const struct disforge_ctx *ctx, const uint8_t *code, size_t code_size)
+{
+    struct disforge_insn insn;
+    size_t i = 0;
 
-            // String operations
-            case 0xA4:
-                printf("MOVSB");
-                i++;
-                break;
-            case 0xA5:
-                printf("MOVSD");
-                i++;
-                break;
-            case 0xA6:
-                printf("CMPSB");
-                i++;
-                break;
-            case 0xA7:
-                printf("CMPSD");
-                i++;
-                break;
-            case 0xAA:
-                printf("STOSB");
-                i++;
+    while (i < code_size) {
+        size_t len = disforge_decode_at(code + i, code_size - i, ctx->base + i, &insn);
+        if (len == 0)
+            break;
+        i += len;
+        if (ctx->insn_fn(ctx->user, &insn, ctx->base + i - len) != 0)
+            break;
+    }
+    return i;
+}
+
+/*
+ * Length-only decoding
+ *
+ * Finding instruction boundaries only needs to know, per opcode, whether a
+ * ModR/M byte and how many immediate bytes follow, and per ModR/M byte how
+ * many SIB/displacement bytes follow. Those facts are folded into three
+ * 256-byte tables, built once from opcode_table/group_table at startup, so
+ * a boundary scan never touches descriptors or operand fields.
+ */
+
+// length_table / length_table_0f entries
+#define LEN_IMM_MASK 0x0F  // immediate bytes
+#define LEN_MODRM    0x10  // a ModR/M byte follows
+#define LEN_PREFIX   0x20  // prefix byte
+#define LEN_ESCAPE   0x40  // look up the next byte in length_table_0f
+#define LEN_IMM_REG01 0x80 // the immediate is only present for ModR/M reg 0 and 1 (F6/F7 TEST)
+
+// modrm_len_table entries
+#define MODRM_LEN_MASK  0x0F  // SIB and displacement bytes after the ModR/M byte
+#define MODRM_SIB_BASE5 0x80  // mod 0 with SIB: a SIB base of 5 adds a disp32
+
+static uint8_t length_table[256];
+static uint8_t length_table_0f[256];
+static uint8_t modrm_len_table[256];
+
+static uint8_t length_entry(const struct opcode_desc *d)
+{
+    if (d->form == F_PREFIX)
+        return LEN_PREFIX;
+    if (d->flags & OPF_ESCAPE)
+        return LEN_ESCAPE;
+    if (!(d->flags & OPF_GROUP))
+        return (d->flags & OPF_MODRM ? LEN_MODRM : 0) | d->imm_size;
+
+    // Group members share the opcode's immediate unless they drop it, which
+    // only the F6/F7 group does (for everything but TEST).
+    const struct opcode_desc *g = group_table[d->mnemonic];
+    uint8_t entry = LEN_MODRM | g[0].imm_size;
+    for (int r = 1; r < 8; r++) {
+        if (g[r].imm_size != g[0].imm_size)
+            entry |= LEN_IMM_REG01;
+    }
+    return entry;
+}
+
+__attribute__((constructor))
+static void length_tables_init(void)
+{
+    for (int b = 0; b < 256; b++) {
+        length_table[b] = length_entry(&opcode_table[b]);
+        length_table_0f[b] = length_entry(&opcode_table_0f[b]);
+
+        uint8_t mod = b >> 6, rm = b & 0x7, len = 0;
+        if (mod != 3) {
+            if (rm == 4)
+                len += 1;
+            if (mod == 1)
+                len += 1;
+            else if (mod == 2 || (mod == 0 && rm == 5))
+                len += 4;
+        }
+        modrm_len_table[b] = len | ((mod == 0 && rm == 4) ? MODRM_SIB_BASE5 : 0);
+    }
+}
+
+/*
+ * disforge_insn_length() returns the length of the instruction at code[0],
+ * exactly as disforge_decode_one() would, but without decoding operands.
+ * Returns 0 if the instruction is truncated by the end of the buffer.
+ */
+size_t disforge_insn_length(const uint8_t *code, size_t code_size)
+{
+    size_t i = 0;
+    uint8_t t;
+
+    if (code_size == 0)
+        return 0;
+    while ((t = length_table[code[i]]) & LEN_PREFIX) {
+        if (i + 1 >= DISFORGE_MAX_INSN_LEN)
+            return 1;
+        if (++i >= code_size)
+            return 0;
+    }
+    i++;
+    if (t & LEN_ESCAPE) {
+        if (i >= code_size)
+            return 0;
+        t = length_table_0f[code[i++]];
+    }
+    if (t & LEN_MODRM) {
+        if (i >= code_size)
+            return 0;
+        uint8_t modrm = code[i++];
+        uint8_t m = modrm_len_table[modrm];
+        if (m & MODRM_SIB_BASE5) {
+            if (i >= code_size)
+                return 0;
+            if ((code[i] & 0x7) == 5)
+                i += 4;
+        }
+        i += m & MODRM_LEN_MASK;
+        if ((t & LEN_IMM_REG01) && ((modrm >> 3) & 0x7) >= 2)
+            t &= ~LEN_IMM_MASK;
+    }
+    i += t & LEN_IMM_MASK;
+    if (i > code_size)
+        return 0;
+    if (i > DISFORGE_MAX_INSN_LEN)
+        return 1;
+    return i;
+}
+
+/*
+ * Speculative SIMD length decoding
+ *
+ * candidate_lengths_avx2() computes, for each of 32 consecutive byte
+ * offsets, the length the instruction would have if one started there:
+ * the opcode's length_table entry is fetched with one 16-entry shuffle per
+ * high nibble, and the ModR/M, SIB, displacement and immediate sizes are
+ * derived with byte compares. Offsets that start with a prefix or a 0x0F
+ * escape get 0 and are left to the scalar decoder. The boundary scans then
+ * walk the real chain through the window, so each window serves several
+ * instructions.
+ */
+
+#define SIMD_WINDOW 32
+// Bytes that must be readable past a window start: the window, plus the
+// longest instruction that can start in it.
+#define SIMD_WINDOW_SPAN (SIMD_WINDOW + 16)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL 1
+
+__attribute__((target("avx2")))
+static void candidate_lengths_avx2(const uint8_t *p, uint8_t *out)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i b0 = _mm256_loadu_si256((const __m256i *) p);
+    __m256i b1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+    __m256i b2 = _mm256_loadu_si256((const __m256i *)(p + 2));
+
+    // t = length_table[b0]
+    __m256i lo = _mm256_and_si256(b0, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(b0, 4), nibble);
+    __m256i t = zero;
+    for (int h = 0; h < 16; h++) {
+        __m256i row = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)(length_table + 16 * h)));
+        __m256i sel = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char) h));
+        t = _mm256_or_si256(t, _mm256_and_si256(sel, _mm256_shuffle_epi8(row, lo)));
+    }
+
+    // ModR/M fields of b1, and the SIB base of b2
+    __m256i mod = _mm256_and_si256(_mm256_srli_epi16(b1, 6), _mm256_set1_epi8(3));
+    __m256i reg = _mm256_and_si256(_mm256_srli_epi16(b1, 3), _mm256_set1_epi8(7));
+    __m256i rm  = _mm256_and_si256(b1, _mm256_set1_epi8(7));
+    __m256i mod0 = _mm256_cmpeq_epi8(mod, zero);
+    __m256i mod1 = _mm256_cmpeq_epi8(mod, _mm256_set1_epi8(1));
+    __m256i mod2 = _mm256_cmpeq_epi8(mod, _mm256_set1_epi8(2));
+    __m256i mod3 = _mm256_cmpeq_epi8(mod, _mm256_set1_epi8(3));
+    __m256i rm4 = _mm256_cmpeq_epi8(rm, _mm256_set1_epi8(4));
+    __m256i rm5 = _mm256_cmpeq_epi8(rm, _mm256_set1_epi8(5));
+    __m256i sib_base5 = _mm256_cmpeq_epi8(_mm256_and_si256(b2, _mm256_set1_epi8(7)),
+                                          _mm256_set1_epi8(5));
+
+    __m256i sib = _mm256_andnot_si256(mod3, rm4);
+    __m256i disp32 = _mm256_or_si256(_mm256_or_si256(mod2, _mm256_and_si256(mod0, rm5)),
+                                     _mm256_and_si256(_mm256_and_si256(mod0, rm4), sib_base5));
+    __m256i four = _mm256_set1_epi8(4);
+    __m256i modrm_len = _mm256_set1_epi8(1);
+    modrm_len = _mm256_sub_epi8(modrm_len, sib);    // masks are -1 per lane
+    modrm_len = _mm256_sub_epi8(modrm_len, mod1);
+    modrm_len = _mm256_add_epi8(modrm_len, _mm256_and_si256(disp32, four));
+
+    __m256i has_modrm = _mm256_cmpeq_epi8(_mm256_and_si256(t, _mm256_set1_epi8(LEN_MODRM)),
+                                          _mm256_set1_epi8(LEN_MODRM));
+    __m256i imm = _mm256_and_si256(t, _mm256_set1_epi8(LEN_IMM_MASK));
+    __m256i reg01_only = _mm256_cmpeq_epi8(_mm256_and_si256(t, _mm256_set1_epi8((char) LEN_IMM_REG01)),
+                                           _mm256_set1_epi8((char) LEN_IMM_REG01));
+    __m256i drop_imm = _mm256_and_si256(_mm256_and_si256(has_modrm, reg01_only),
+                                        _mm256_cmpgt_epi8(reg, _mm256_set1_epi8(1)));
+    imm = _mm256_andnot_si256(drop_imm, imm);
+
+    __m256i len = _mm256_add_epi8(_mm256_set1_epi8(1), imm);
+    len = _mm256_add_epi8(len, _mm256_and_si256(has_modrm, modrm_len));
+    __m256i simple = _mm256_cmpeq_epi8(_mm256_and_si256(t, _mm256_set1_epi8(LEN_PREFIX | LEN_ESCAPE)),
+                                       zero);
+    len = _mm256_and_si256(simple, len);
+    _mm256_storeu_si256((__m256i *) out, len);
+}
+#endif
+
+// A window of candidate lengths, valid for offsets [base, base + SIMD_WINDOW).
+struct len_window {
+    int    simd;
+    size_t base;
+    uint8_t len[SIMD_WINDOW];
+};
+
+static void len_window_init(struct len_window *win)
+{
+#ifdef HAVE_AVX2_KERNEL
+    win->simd = __builtin_cpu_supports("avx2");
+#else
+    win->simd = 0;
+#endif
+    win->base = SIZE_MAX;
+}
+
+// Same result as disforge_insn_length(code + p, code_size - p).
+static inline size_t len_window_length(struct len_window *win, const uint8_t *code,
+                                       size_t code_size, size_t p)
+{
+#ifdef HAVE_AVX2_KERNEL
+    if (win->simd && code_size - p >= SIMD_WINDOW_SPAN) {
+        if (p < win->base || p - win->base >= SIMD_WINDOW) {
+            candidate_lengths_avx2(code + p, win->len);
+            win->base = p;
+        }
+        if (win->len[p - win->base] != 0)
+            return win->len[p - win->base];
+    }
+#else
+    (void) win;
+#endif
+    return disforge_insn_length(code + p, code_size - p);
+}
+
+/*
+ * disforge_find_boundaries() marks the start of every instruction of a
+ * linear sweep over code in bitmap (bit i % 64 of word i / 64 for offset
+ * i), which must hold (code_size + 63) / 64 words; it is cleared first. A
+ * trailing truncated instruction is marked too. Returns the number of
+ * instructions.
+ */
+size_t disforge_find_boundaries(const uint8_t *code, size_t code_size, uint64_t *bitmap)
+{
+    struct len_window win;
+    size_t count = 0, i = 0;
+
+    len_window_init(&win);
+    memset(bitmap, 0, (code_size + 63) / 64 * sizeof(uint64_t));
+    while (i < code_size) {
+        bitmap[i / 64] |= (uint64_t) 1 << (i % 64);
+        count++;
+        size_t len = len_window_length(&win, code, code_size, i);
+        if (len == 0)
+            break;
+        i += len;
+    }
+    return count;
+}
+
+/*
+ * disforge_find_offsets() stores the start offsets of up to max
+ * instructions of a linear sweep from code[0] into offsets and returns how
+ * many it stored. *next receives the offset of the first instruction not
+ * stored, or code_size once the buffer is exhausted, so a scan can continue
+ * with a later call. A trailing truncated instruction is stored too.
+ */
+size_t disforge_find_offsets(const uint8_t *code, size_t code_size, size_t *offsets, size_t max,
+                             size_t *next)
+{
+    struct len_window win;
+    size_t count = 0, i = 0;
+
+    len_window_init(&win);
+    while (i < code_size && count < max) {
+        offsets[count++] = i;
+        size_t len = len_window_length(&win, code, code_size, i);
+        if (len == 0) {
+            i = code_size;
+            break;
+        }
+        i += len;
+    }
+    *next = i;
+    return count;
+}
+
+// Longest operand format_rm_operand() produces: "[EAX + EAX*8 - 0x80000000]"
+#define RM_OPERAND_MAX 32
+
+static inline char *put_reg(char *p, uint8_t reg)
+{
+    memcpy(p, reg_names[reg], 4);   // copies the terminator too, overwritten later
+    return p + reg_name_len[reg];
+}
+
+/*
+ * format_rm_operand() writes the memory operand of insn, e.g.
+ * "[EBX + ECX*4 + 0x10]", into buffer, which must hold at least
+ * RM_OPERAND_MAX bytes. The result is not NUL-terminated. Returns the
+ * string length.
+ */
+static int format_rm_operand(const struct disforge_insn *insn, char *buffer)
+{
+    char *p = buffer;
+
+    *p++ = '[';
+    if (insn->base != DISFORGE_REG_NONE)
+        p = put_reg(p, insn->base);
+    if (insn->index != DISFORGE_REG_NONE) {
+        if (p != buffer + 1) {
+            memcpy(p, " + ", 3);
+            p += 3;
+        }
+        p = put_reg(p, insn->index);
+        if (insn->scale > 1) {
+            *p++ = '*';
+            *p++ = (char)('0' + insn->scale);
+        }
+    }
+    if (insn->flags & DISFORGE_INSN_DISP) {
+        uint32_t disp = (uint32_t) insn->disp;
+        if (p != buffer + 1) {
+            if (insn->disp < 0) {
+                memcpy(p, " - ", 3);
+                disp = 0u - disp;
+            } else {
+                memcpy(p, " + ", 3);
+            }
+            p += 3;
+        }
+        *p++ = '0';
+        *p++ = 'x';
+        p += hex_to_buf(p, disp, 1);
+    }
+    *p++ = ']';
+    return (int)(p - buffer);
+}
+
+// disforge_print_insn() prints one decoded instruction (no address or newline).
+void disforge_print_insn(struct disforge_sink *out, const struct disforge_insn *insn)
+{
+    for (int p = 0; p < 3; p++) {
+        if (insn->prefixes & (1 << p)) {
+            disforge_sink_puts(out, mnemonic_names[DISFORGE_MN_LOCK + p]);
+            disforge_sink_putc(out, ' ');
+        }
+    }
+
+    if (insn->length == 0) {
+        // Truncated: name whatever part of the instruction was recognised.
+        // A zero opcode with no mnemonic means only prefixes were seen
+        // (0x00 itself is ADD).
+        disforge_sink_puts(out, "Incomplete ");
+        if (insn->mnemonic != DISFORGE_MN_INVALID) {
+            disforge_sink_puts(out, mnemonic_names[insn->mnemonic]);
+            disforge_sink_putc(out, ' ');
+        } else if (insn->opcode != 0) {
+            sink_hex_byte_upper(out, insn->opcode);
+            disforge_sink_putc(out, ' ');
+        }
+        disforge_sink_puts(out, "instruction");
+        return;
+    }
+
+    if (insn->mnemonic == DISFORGE_MN_INVALID) {
+        if (insn->opcode == 0x0F || (insn->flags & DISFORGE_INSN_MODRM)) {
+            disforge_sink_puts(out, "Unknown ");
+            sink_hex_byte_upper(out, insn->opcode);
+            disforge_sink_puts(out, " instruction");
+        } else {
+            disforge_sink_puts(out, "Unknown instruction: 0x");
+            disforge_sink_hex(out, insn->opcode, 2);
+        }
+        return;
+    }
+
+    disforge_sink_puts(out, mnemonic_names[insn->mnemonic]);
+    if (insn->mnemonic == DISFORGE_MN_JCC)
+        print_condition(out, insn->cond);
+
+    for (int n = 0; n < 2 && insn->op[n] != DISFORGE_OP_NONE; n++) {
+        if (n == 0)
+            disforge_sink_putc(out, ' ');
+        else
+            disforge_sink_write(out, ", ", 2);
+        // Only MOVZX/MOVSX r32, r/m8 carry the byte qualifier, on their source.
+        if ((insn->flags & DISFORGE_INSN_BYTE_PTR) && n == 1)
+            disforge_sink_puts(out, "BYTE PTR ");
+        switch (insn->op[n]) {
+            case DISFORGE_OP_REG:
+                print_reg(out, insn->op_reg[n]);
                 break;
-            case 0xAB:
-                printf("STOSD");
-                i++;
+            case DISFORGE_OP_MEM:
+                // Format straight into the sink's buffer.
+                if (out->cap - out->len < RM_OPERAND_MAX)
+                    disforge_sink_make_room(out, RM_OPERAND_MAX);
+                out->len += format_rm_operand(insn, out->buf + out->len);
                 break;
-            case 0xAC:
-                printf("LODSB");
-                i++;
+            case DISFORGE_OP_IMM:
+                disforge_sink_write(out, "0x", 2);
+                disforge_sink_hex(out, insn->imm, insn->imm_size * 2);
                 break;
-            case 0xAD:
-                printf("LODSD");
-                i++;
+            case DISFORGE_OP_REL:
+                disforge_sink_write(out, "0x", 2);
+                disforge_sink_hex(out, insn->target, 8);
                 break;
-            case 0xAE:
-                printf("SCASB");
-                i++;
+            case DISFORGE_OP_ONE:
+                disforge_sink_putc(out, '1');
                 break;
-            case 0xAF:
-                printf("SCASD");
-                i++;
+            case DISFORGE_OP_CL:
+                disforge_sink_write(out, "CL", 2);
                 break;
+        }
+    }
+}
 
-            // Prefix bytes
-            case 0xF0:
-                printf("LOCK ");
-                i++;
-                break;
-            case 0xF2:
-                printf("REPNZ ");
-                i++;
-                break;
-            case 0xF3: {
-                printf("REP ");
-                i++;
-                if (i < code_size) {
-                    opcode = code[i];
-                    if (opcode == 0xA4) {
-                        printf("MOVSB");
-                        i++;
-                    } else if (opcode == 0xA5) {
-                        printf("MOVSD");
-                        i++;
-                    } else {
-                        printf("Unknown REP instruction");
-                        i++;
-                    }
-                } else {
-                    printf("Incomplete REP instruction");
-                    i++;
-                }
+/*
+ * Binary records (see disforge.h)
+ */
+
+_Static_assert(sizeof(struct disforge_record) == 32, "records are 32 bytes");
+
+static void write_record_header(struct disforge_sink *out)
+{
+    struct disforge_record_header hdr = {
+        .magic = DISFORGE_RECORD_MAGIC,
+        .version = DISFORGE_RECORD_VERSION,
+        .byte_order = 0x0102,
+        .record_size = sizeof(struct disforge_record),
+        .mnemonic_count = DISFORGE_MN_COUNT,
+        .register_count = 8,
+    };
+    size_t names = 0;
+
+    for (int n = 0; n < DISFORGE_MN_COUNT; n++)
+        names += strlen(mnemonic_names[n]) + 1;
+    for (int n = 0; n < 8; n++)
+        names += strlen(reg_names[n]) + 1;
+    hdr.names_size = (uint32_t)((names + 7) & ~(size_t) 7);
+    disforge_sink_write(out, (const char *) &hdr, sizeof(hdr));
+    for (int n = 0; n < DISFORGE_MN_COUNT; n++)
+        disforge_sink_write(out, mnemonic_names[n], strlen(mnemonic_names[n]) + 1);
+    for (int n = 0; n < 8; n++)
+        disforge_sink_write(out, reg_names[n], strlen(reg_names[n]) + 1);
+    disforge_sink_write(out, "\0\0\0\0\0\0\0", hdr.names_size - names);
+}
+
+static inline void put_record(struct disforge_sink *out, const struct disforge_insn *insn,
+                              size_t address)
+{
+    struct disforge_record r = {
+        .address = address,
+        .length = insn->length,
+        .mnemonic = insn->mnemonic,
+        .prefixes = insn->prefixes,
+        .flags = insn->flags,
+        .op = {insn->op[0], insn->op[1]},
+        .op_reg = {insn->op_reg[0], insn->op_reg[1]},
+        .base = insn->base,
+        .index = insn->index,
+        .scale = insn->scale,
+        .cond = insn->cond,
+        .opcode = insn->opcode,
+        .opcode2 = insn->opcode2,
+        .modrm = insn->modrm,
+        .imm_size = insn->imm_size,
+        .disp = insn->disp,
+        .value = insn->op[0] == DISFORGE_OP_REL ? insn->target : insn->imm,
+    };
+    disforge_sink_write(out, (const char *) &r, sizeof(r));
+}
+
+/*
+ * disforge_list_header() starts a listing: the text title, or the record stream
+ * header.
+ */
+void disforge_list_header(struct disforge_sink *out, const char *title, const char *name)
+{
+    if (out->format == DISFORGE_RECORDS) {
+        write_record_header(out);
+        return;
+    }
+    disforge_sink_puts(out, title);
+    if (name) {
+        disforge_sink_puts(out, " '");
+        disforge_sink_puts(out, name);
+        disforge_sink_putc(out, '\'');
+    }
+    disforge_sink_write(out, ":\n", 2);
+}
+
+/*
+ * disforge_list_insn() writes the listing line (or record) of an instruction
+ * decoded at address.
+ */
+void disforge_list_insn(struct disforge_sink *out, const struct disforge_insn *insn, size_t address)
+{
+    if (out->format == DISFORGE_RECORDS) {
+        put_record(out, insn, address);
+        return;
+    }
+    STATS_TSC(t0);
+    disforge_sink_hex(out, address, 4);
+    disforge_sink_write(out, ": ", 2);
+    disforge_print_insn(out, insn);
+    disforge_sink_putc(out, '\n');
+    STATS_FORMAT(insn, t0);
+}
+
+/*
+ * disforge_disassemble_line() decodes the instruction at code[i] and writes its
+ * listing line, with the address column showing base + i. Returns its
+ * length, or 0 if it is truncated by the end of the buffer (the line then
+ * reports the truncation).
+ */
+size_t disforge_disassemble_line(struct disforge_sink *out, const uint8_t *code, size_t code_size,
+                                 size_t base, size_t i)
+{
+    struct disforge_insn insn;
+
+    size_t len = disforge_decode_at(code + i, code_size - i, base + i, &insn);
+    disforge_list_insn(out, &insn, base + i);
+    return len;
+}
+
+/*
+ * disassemble_range() lists the instructions that start in [from, to) and
+ * returns the offset just past the last one, or code_size if the listing
+ * ended on a truncated instruction.
+ */
+static size_t disassemble_range(struct disforge_sink *out, const uint8_t *code, size_t code_size,
+                                size_t base, size_t from, size_t to)
+{
+    size_t i = from;
+    while (i < to) {
+        size_t len = disforge_disassemble_line(out, code, code_size, base, i);
+        if (len == 0)
+            return code_size;
+        i += len;
+    }
+    return i;
+}
+
+/*
+ * disforge_disassemble() reads the given machine code (of code_size bytes)
+ * and writes a textual disassembly to out, one disforge_decode_one() record
+ * at a time. base is the address of code[0] shown in the address column. The
+ * caller flushes out.
+ */
+void disforge_disassemble(struct disforge_sink *out, const uint8_t *code, size_t code_size,
+                          size_t base) {
+    disassemble_range(out, code, code_size, base, 0, code_size);
+}
+
+/*
+ * Parallel disassembly
+ *
+ * The input is cut into PAR_CHUNK_SIZE chunks which worker threads list
+ * into per-chunk memory sinks, each starting at the first byte of its
+ * chunk. That guess is usually wrong: the real instruction stream enters a
+ * chunk somewhere in its first DISFORGE_MAX_INSN_LEN bytes. So the worker
+ * also decodes from every one of those candidate offsets until the
+ * candidate lands on an instruction of its own listing (x86 streams
+ * resynchronise within a few instructions). The main thread then stitches
+ * the chunks together in order: it lists the few instructions between the
+ * real entry point and the convergence point itself and copies the rest of
+ * the chunk's text. A chunk whose candidates do not converge within
+ * PAR_SYNC_WINDOW bytes is re-listed serially, so the output is always
+ * identical to disforge_disassemble().
+ */
+
+#ifndef PAR_CHUNK_SIZE
+#define PAR_CHUNK_SIZE (256 * 1024)
+#endif
+#define PAR_SYNC_WINDOW 64
+#define PAR_NO_TEXT UINT32_MAX
+
+struct par_chunk {
+    size_t   id;            // chunk number, valid while done is set
+    int      done;
+    size_t   start, end;    // byte range [start, end) of the chunk
+    size_t   main_end;      // end of the listing that starts at start
+    uint32_t text_at[PAR_SYNC_WINDOW];    // text offset of the instruction at start + k
+    int8_t   conv[DISFORGE_MAX_INSN_LEN]; // where candidate start + k meets the listing, or -1
+    struct disforge_sink text;
+};
+
+struct par_state {
+    const uint8_t *code;
+    size_t code_size;
+    size_t base;
+    size_t nchunks;
+    struct par_chunk *slots;  // chunk n lives in slots[n % nslots]
+    size_t nslots;
+    size_t next;              // next chunk to hand to a worker
+    size_t consumed;          // chunks already written out
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void par_list_chunk(const uint8_t *code, size_t code_size, size_t base,
+                           struct par_chunk *c)
+{
+    size_t i = c->start;
+
+    // A slot is reused; an earlier chunk's ENOMEM must not stick to it.
+    c->text.len = 0;
+    c->text.error = 0;
+    for (int k = 0; k < PAR_SYNC_WINDOW; k++)
+        c->text_at[k] = PAR_NO_TEXT;
+    while (i < c->end) {
+        if (i - c->start < PAR_SYNC_WINDOW)
+            c->text_at[i - c->start] = (uint32_t) c->text.len;
+        size_t len = disforge_disassemble_line(&c->text, code, code_size, base, i);
+        if (len == 0) {
+            i = code_size;
+            break;
+        }
+        i += len;
+    }
+    c->main_end = i;
+
+    for (int k = 0; k < DISFORGE_MAX_INSN_LEN; k++) {
+        size_t p = c->start + k;
+        c->conv[k] = -1;
+        while (p < c->end && p - c->start < PAR_SYNC_WINDOW) {
+            if (c->text_at[p - c->start] != PAR_NO_TEXT) {
+                c->conv[k] = (int8_t)(p - c->start);
                 break;
             }
-
-            default:
-                printf("Unknown instruction: 0x%02x", opcode);
-                i++;
+            size_t len = disforge_insn_length(code + p, code_size - p);
+            if (len == 0)
                 break;
+            p += len;
         }
-        printf("\n");
-    }
-}
-
-/* Uncomment this section if you want to test with a binary file
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <machine_code_file>\n", argv[0]);
-        return EXIT_FAILURE;
-    }
-
-    const char *filename = argv[1];
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("Error opening file");
-        return EXIT_FAILURE;
-    }
-
-    // Determine file size
-    if (fseek(fp, 0, SEEK_END) != 0) {
-        perror("Error seeking file");
-        fclose(fp);
-        return EXIT_FAILURE;
-    }
-    long file_size = ftell(fp);
-    if (file_size < 0) {
-        perror("Error determining file size");
-        fclose(fp);
-        return EXIT_FAILURE;
-    }
-    rewind(fp);
-
-    // Allocate buffer to hold the machine code.
-    uint8_t *buffer = malloc(file_size);
-    if (!buffer) {
-        perror("Memory allocation error");
-        fclose(fp);
-        return EXIT_FAILURE;
-    }
-
-    size_t read = fread(buffer, 1, file_size, fp);
-    if (read != (size_t)file_size) {
-        fprintf(stderr, "Error reading file (read %zu bytes, expected %ld)\n", read, file_size);
-        free(buffer);
-        fclose(fp);
-        return EXIT_FAILURE;
-    }
-    fclose(fp);
-
-    printf("Disassembled code from file '%s':\n", filename);
-    disassemble(buffer, read);
-
-    free(buffer);
-    return EXIT_SUCCESS;
-}
-*/
-
-int main() {
-    // Example machine code containing a variety of instructions.
-    uint8_t code[] = {
-        0x90,                               // NOP
-        0xB8, 0x78, 0x56, 0x34, 0x12,         // MOV EAX, 0x12345678
-        0xB9, 0xEF, 0xCD, 0xAB, 0x90,         // MOV ECX, 0x90ABCDEF
-        0x03, 0xC1,                         // ADD EAX, ECX   (ModR/M: both operands registers)
-        0x83, 0xE8, 0x05,                   // SUB EAX, 5     (immediate arithmetic)
-        0x89, 0xC3,                         // MOV EBX, EAX
-        0x01, 0xCB,                         // ADD EBX, ECX
-        0x29, 0xC3,                         // SUB EBX, EAX
-        0xF7, 0xE3,                         // MUL EBX       (F7 /4)
-        0xE8, 0x12, 0x34, 0x56, 0x78,         // CALL 0x78563412
-        0x74, 0x05,                         // JE +5
-        0xE9, 0x78, 0x56, 0x34, 0x12,         // JMP 0x12345678
-        0xFF, 0xC0,                         // INC EAX       (FF /0)
-        0xFF, 0xC8,                         // DEC EAX       (FF /1)
-        0x0F, 0xB6, 0xC0,                   // MOVZX EAX, AL
-        0x0F, 0xBE, 0xC0,                   // MOVSX EAX, AL
-        0xF3, 0xA4,                         // REP MOVSB
-        0x86, 0xC1,                         // XCHG AL, CL
-        0xD1, 0xE0,                         // SHL EAX, 1
-        0xE2, 0xFE,                         // LOOP -2
-        0xC3                                // RET
+    }
+}
+
+static void *par_worker(void *arg)
+{
+    struct par_state *st = arg;
+
+    pthread_mutex_lock(&st->lock);
+    while (st->next < st->nchunks) {
+        size_t n = st->next++;
+        while (n >= st->consumed + st->nslots)
+            pthread_cond_wait(&st->cond, &st->lock);
+        pthread_mutex_unlock(&st->lock);
+
+        struct par_chunk *c = &st->slots[n % st->nslots];
+        c->start = n * PAR_CHUNK_SIZE;
+        c->end = c->start + PAR_CHUNK_SIZE < st->code_size ? c->start + PAR_CHUNK_SIZE : st->code_size;
+        par_list_chunk(st->code, st->code_size, st->base, c);
+
+        pthread_mutex_lock(&st->lock);
+        c->id = n;
+        c->done = 1;
+        pthread_cond_broadcast(&st->cond);
+    }
+    pthread_mutex_unlock(&st->lock);
+    STATS_MERGE();
+    return NULL;
+}
+
+// Append chunk c to out, given that the real instruction stream enters it at p.
+static size_t par_stitch(struct disforge_sink *out, const uint8_t *code, size_t code_size,
+                         size_t base, const struct par_chunk *c, size_t p)
+{
+    if (p >= c->end)
+        return p;   // swallowed by the previous chunk's last instruction
+    if (c->text.error || p - c->start >= DISFORGE_MAX_INSN_LEN || c->conv[p - c->start] < 0)
+        return disassemble_range(out, code, code_size, base, p, c->end);
+
+    size_t meet = c->start + c->conv[p - c->start];
+    if (disassemble_range(out, code, code_size, base, p, meet) != meet)
+        return code_size;
+    uint32_t at = c->text_at[meet - c->start];
+    disforge_sink_write(out, c->text.buf + at, c->text.len - at);
+    return c->main_end;
+}
+
+/*
+ * disforge_disassemble_parallel() writes the same listing as
+ * disforge_disassemble() using up to nthreads worker threads. Small inputs,
+ * and setups where no worker can be started, are listed serially.
+ */
+void disforge_disassemble_parallel(struct disforge_sink *out, const uint8_t *code, size_t code_size,
+                                   size_t base, int nthreads)
+{
+    struct par_state st = {
+        .code = code,
+        .code_size = code_size,
+        .base = base,
+        .nchunks = (code_size + PAR_CHUNK_SIZE - 1) / PAR_CHUNK_SIZE,
     };
-    size_t code_size = sizeof(code) / sizeof(code[0]);
-    
-    printf("Disassembled code:\n");
-    disassemble(code, code_size);
-    
-    return 0;
-}
\ No newline at end of file
+    if (nthreads < 2 || st.nchunks < 2) {
+        disforge_disassemble(out, code, code_size, base);
+        return;
+    }
+
+    st.nslots = 2 * (size_t) nthreads;
+    st.slots = calloc(st.nslots, sizeof(*st.slots));
+    pthread_t *threads = calloc(nthreads, sizeof(*threads));
+    if (!st.slots || !threads) {
+        free(st.slots);
+        free(threads);
+        disforge_disassemble(out, code, code_size, base);
+        return;
+    }
+    for (size_t n = 0; n < st.nslots; n++) {
+        disforge_sink_init_mem(&st.slots[n].text, PAR_CHUNK_SIZE * 4);
+        st.slots[n].text.format = out->format;
+    }
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+
+    int started = 0;
+    while (started < nthreads && pthread_create(&threads[started], NULL, par_worker, &st) == 0)
+        started++;
+
+    size_t p = 0;
+    if (started == 0) {
+        disforge_disassemble(out, code, code_size, base);
+    } else {
+        for (size_t n = 0; n < st.nchunks; n++) {
+            struct par_chunk *c = &st.slots[n % st.nslots];
+            pthread_mutex_lock(&st.lock);
+            while (!(c->done && c->id == n))
+                pthread_cond_wait(&st.cond, &st.lock);
+            pthread_mutex_unlock(&st.lock);
+
+            if (p < code_size)
+                p = par_stitch(out, code, code_size, base, c, p);
+
+            pthread_mutex_lock(&st.lock);
+            c->done = 0;
+            st.consumed++;
+            pthread_cond_broadcast(&st.cond);
+            pthread_mutex_unlock(&st.lock);
+        }
+    }
+
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    pthread_cond_destroy(&st.cond);
+    pthread_mutex_destroy(&st.lock);
+    for (size_t n = 0; n < st.nslots; n++)
+        disforge_sink_free_mem(&st.slots[n].text);
+    free(st.slots);
+    free(threads);
+}
+
+/*
+ * Pipelined disassembly
+ *
+ * disforge_disassemble_pipelined() splits a linear listing into three stages: a
+ * decoder thread fills batches of PIPE_BATCH decoded instructions,
+ * formatter threads render batches into text slabs, and the calling thread
+ * writes the slabs to the output. Batch k goes to formatter k % n, and
+ * every formatter has its own ring of PIPE_DEPTH slots, so each ring has a
+ * single producer per stage: the decoder fills a slot, the formatter
+ * renders it, and the writer empties it and hands it back. The writer
+ * visits the rings round-robin, which keeps the output in order without
+ * any reordering.
+ *
+ * Each stage publishes its progress in a cursor of its own, using a release
+ * store, and reads the others with acquire loads. No locks are taken. A
+ * stage that finds nothing to do spins briefly and then sleeps on the
+ * cursor with futex(2) until it changes.
+ */
+
+#define PIPE_BATCH 1024
+#define PIPE_DEPTH 4
+#define PIPE_SPIN  256
+
+struct pipe_slot {
+    size_t count;                         // instructions in insns
+    int    last;                          // the end of the input, nothing to format
+    size_t address[PIPE_BATCH];
+    struct disforge_insn insns[PIPE_BATCH];
+    struct disforge_sink text;                 // memory sink the formatter renders into
+};
+
+// Slot k of a ring is slot[k % PIPE_DEPTH]; each cursor counts slots.
+struct pipe_ring {
+    uint32_t decoded __attribute__((aligned(64)));    // written by the decoder
+    uint32_t formatted __attribute__((aligned(64)));  // written by the formatter
+    uint32_t written __attribute__((aligned(64)));    // written by the writer
+    struct pipe_slot slot[PIPE_DEPTH];
+};
+
+struct pipe_state {
+    const uint8_t *code;
+    size_t code_size;
+    size_t base;
+    struct pipe_ring *rings;
+    int nrings;
+};
+
+// Wait until *cursor differs from seen and return its new value.
+static uint32_t pipe_wait(uint32_t *cursor, uint32_t seen)
+{
+    uint32_t now;
+
+    for (int spin = 0; spin < PIPE_SPIN; spin++) {
+        if ((now = __atomic_load_n(cursor, __ATOMIC_ACQUIRE)) != seen)
+            return now;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    while ((now = __atomic_load_n(cursor, __ATOMIC_ACQUIRE)) == seen)
+        syscall(SYS_futex, cursor, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    return now;
+}
+
+// Advance *cursor to value and wake a stage sleeping on it.
+static void pipe_publish(uint32_t *cursor, uint32_t value)
+{
+    __atomic_store_n(cursor, value, __ATOMIC_RELEASE);
+    syscall(SYS_futex, cursor, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Wait for a free slot in ring r (slot number k) and return it.
+static struct pipe_slot *pipe_claim(struct pipe_ring *r, uint32_t k)
+{
+    uint32_t written = __atomic_load_n(&r->written, __ATOMIC_ACQUIRE);
+    while (k - written >= PIPE_DEPTH)
+        written = pipe_wait(&r->written, written);
+    return &r->slot[k % PIPE_DEPTH];
+}
+
+// Queue an end marker on every ring, as batches first, first + 1, ...
+static void pipe_end(struct pipe_state *st, uint32_t first)
+{
+    for (int n = 0; n < st->nrings; n++) {
+        uint32_t batch = first + (uint32_t) n;
+        struct pipe_ring *r = &st->rings[batch % st->nrings];
+        struct pipe_slot *s = pipe_claim(r, batch / st->nrings);
+
+        s->count = 0;
+        s->last = 1;
+        pipe_publish(&r->decoded, batch / st->nrings + 1);
+    }
+}
+
+static void *pipe_decoder(void *arg)
+{
+    struct pipe_state *st = arg;
+    uint32_t batch = 0;
+    size_t i = 0;
+
+    do {
+        struct pipe_ring *r = &st->rings[batch % st->nrings];
+        uint32_t k = batch++ / st->nrings;
+        struct pipe_slot *s = pipe_claim(r, k);
+
+        s->count = 0;
+        s->last = 0;
+        while (s->count < PIPE_BATCH && i < st->code_size) {
+            size_t len = disforge_decode_at(st->code + i, st->code_size - i, st->base + i,
+                                            &s->insns[s->count]);
+            s->address[s->count++] = st->base + i;
+            i = len ? i + len : st->code_size;   // a truncated instruction ends the listing
+        }
+        pipe_publish(&r->decoded, k + 1);
+    } while (i < st->code_size);
+    pipe_end(st, batch);
+    STATS_MERGE();
+    return NULL;
+}
+
+static void *pipe_formatter(void *arg)
+{
+    struct pipe_ring *r = arg;
+    uint32_t decoded = 0;
+
+    for (uint32_t k = 0;; k++) {
+        while (decoded <= k)
+            decoded = pipe_wait(&r->decoded, decoded);
+        struct pipe_slot *s = &r->slot[k % PIPE_DEPTH];
+        int last = s->last;   // the slot is not ours once it is published
+        if (!last) {
+            s->text.len = 0;
+            for (size_t n = 0; n < s->count; n++)
+                disforge_list_insn(&s->text, &s->insns[n], s->address[n]);
+        }
+        pipe_publish(&r->formatted, k + 1);
+        if (last)
+            break;
+    }
+    STATS_MERGE();
+    return NULL;
+}
+
+/*
+ * disforge_disassemble_pipelined() writes the same listing as
+ * disforge_disassemble(), with decoding and formatting running on their own
+ * threads (nformatters of them for formatting) while the calling thread
+ * writes. Small inputs, and setups where the threads cannot be started, are
+ * listed serially.
+ */
+void disforge_disassemble_pipelined(struct disforge_sink *out, const uint8_t *code,
+                                    size_t code_size, size_t base, int nformatters)
+{
+    struct pipe_state st = { .code = code, .code_size = code_size, .base = base };
+    pthread_t *formatters = NULL, decoder;
+    void *rings = NULL;
+    int started = 0, listed = 0;
+
+    if (nformatters < 1 || code_size < 4 * PIPE_BATCH)
+        goto serial;
+    formatters = calloc(nformatters, sizeof(*formatters));
+    if (!formatters || posix_memalign(&rings, 64, nformatters * sizeof(*st.rings)) != 0)
+        goto serial;
+    memset(rings, 0, nformatters * sizeof(*st.rings));
+    st.rings = rings;
+    for (int n = 0; n < nformatters; n++) {
+        for (int k = 0; k < PIPE_DEPTH; k++) {
+            disforge_sink_init_mem(&st.rings[n].slot[k].text, 64 * 1024);
+            st.rings[n].slot[k].text.format = out->format;
+        }
+    }
+
+    while (started < nformatters && pthread_create(&formatters[started], NULL,
+                                                   pipe_formatter, &st.rings[started]) == 0)
+        started++;
+    st.nrings = started;
+    if (started == 0)
+        goto serial;
+    if (pthread_create(&decoder, NULL, pipe_decoder, &st) != 0) {
+        pipe_end(&st, 0);
+        goto serial;
+    }
+
+    for (uint32_t batch = 0;; batch++) {
+        struct pipe_ring *r = &st.rings[batch % st.nrings];
+        uint32_t k = batch / st.nrings;
+        uint32_t formatted = __atomic_load_n(&r->formatted, __ATOMIC_ACQUIRE);
+        while (formatted <= k)
+            formatted = pipe_wait(&r->formatted, formatted);
+        struct pipe_slot *s = &r->slot[k % PIPE_DEPTH];
+        if (s->last)
+            break;
+        if (s->text.error && !out->error)
+            out->error = s->text.error;
+        disforge_sink_write(out, s->text.buf, s->text.len);
+        pipe_publish(&r->written, k + 1);
+    }
+    pthread_join(decoder, NULL);
+    listed = 1;
+
+serial:
+    for (int n = 0; n < started; n++)
+        pthread_join(formatters[n], NULL);
+    if (!listed)
+        disforge_disassemble(out, code, code_size, base);
+    for (int n = 0; rings && n < nformatters; n++)
+        for (int k = 0; k < PIPE_DEPTH; k++)
+            disforge_sink_free_mem(&st.rings[n].slot[k].text);
+    free(rings);
+    free(formatters);
+}
+
+/*
+ * Recursive descent
+ *
+ * Instead of sweeping the whole buffer, recursive descent decodes from a
+ * set of entry points and follows control flow: relative CALL, JMP, Jcc,
+ * LOOP* and JECXZ targets are queued on a worklist, and every instruction
+ * start is recorded in a bitmap so each instruction is decoded once. Bytes
+ * never reached (data, padding, code only reached indirectly) are listed
+ * as data instead of desynchronising the instructions that follow them.
+ */
+
+/*
+ * insn_branch_target() stores the buffer offset a relative branch at
+ * offset jumps to in *target and returns 1; returns 0 for instructions
+ * without a relative target.
+ */
+static inline int insn_branch_target(const struct disforge_insn *insn, size_t offset,
+                                     size_t *target)
+{
+    if (insn->op[0] != DISFORGE_OP_REL)
+        return 0;
+    *target = offset + insn->length + (size_t)(int64_t)(int32_t) insn->imm;
+    return 1;
+}
+
+// Whether execution can continue with the next instruction.
+static inline int insn_falls_through(const struct disforge_insn *insn)
+{
+    return insn->length != 0 && insn->mnemonic != DISFORGE_MN_INVALID &&
+           insn->mnemonic != DISFORGE_MN_JMP && insn->mnemonic != DISFORGE_MN_RET;
+}
+
+static inline int bitmap_test(const uint64_t *bitmap, size_t i)
+{
+    return (bitmap[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bitmap_set(uint64_t *bitmap, size_t i)
+{
+    bitmap[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+// Instructions kept by descend() for the listing, in the order they were found.
+struct descent_insns {
+    struct disforge_insn *insn;
+    size_t *offset;
+    size_t  n, cap;
+};
+
+static int descent_keep(struct descent_insns *kept, const struct disforge_insn *insn,
+                        size_t offset)
+{
+    if (kept->n == kept->cap) {
+        size_t cap = kept->cap ? 2 * kept->cap : 1024;
+        struct disforge_insn *insns = realloc(kept->insn, cap * sizeof(*insns));
+        if (!insns)
+            return -1;
+        kept->insn = insns;
+        size_t *offsets = realloc(kept->offset, cap * sizeof(*offsets));
+        if (!offsets)
+            return -1;
+        kept->offset = offsets;
+        kept->cap = cap;
+    }
+    kept->insn[kept->n] = *insn;
+    kept->offset[kept->n++] = offset;
+    return 0;
+}
+
+/*
+ * descend() is disforge_recursive() for code loaded at base. If kept is
+ * not NULL, every instruction decoded is also appended to it, so a
+ * listing need not decode it again.
+ */
+static size_t descend(const uint8_t *code, size_t code_size, size_t base, const size_t *entries,
+                      size_t nentries, uint64_t *starts, struct descent_insns *kept)
+{
+    size_t cap = nentries > 64 ? nentries : 64;
+    size_t *work = malloc(cap * sizeof(*work));
+    size_t nwork = 0, count = 0;
+
+    memset(starts, 0, (code_size + 63) / 64 * sizeof(uint64_t));
+    if (!work)
+        return SIZE_MAX;
+    for (size_t n = 0; n < nentries; n++)
+        if (entries[n] < code_size)
+            work[nwork++] = entries[n];
+
+    while (nwork > 0) {
+        size_t i = work[--nwork];
+        // Follow one path until it stops or joins code already decoded.
+        while (i < code_size && !bitmap_test(starts, i)) {
+            struct disforge_insn insn;
+            size_t target;
+
+            bitmap_set(starts, i);
+            count++;
+            disforge_decode_at(code + i, code_size - i, base + i, &insn);
+            if (kept && descent_keep(kept, &insn, i) != 0) {
+                free(work);
+                return SIZE_MAX;
+            }
+            if (insn_branch_target(&insn, i, &target) && target < code_size &&
+                !bitmap_test(starts, target)) {
+                if (nwork == cap) {
+                    size_t *grown = realloc(work, 2 * cap * sizeof(*work));
+                    if (!grown) {
+                        free(work);
+                        return SIZE_MAX;
+                    }
+                    work = grown;
+                    cap *= 2;
+                }
+                work[nwork++] = target;
+            }
+            if (!insn_falls_through(&insn))
+                break;
+            i += insn.length;
+        }
+    }
+    free(work);
+    return count;
+}
+
+/*
+ * disforge_recursive() marks in starts ((code_size + 63) / 64 words,
+ * cleared first) every instruction reachable from the given entry offsets
+ * by following fall-through and relative branches within code. Entries
+ * and targets outside code are ignored. Returns the number of instructions
+ * found, or SIZE_MAX if out of memory.
+ */
+size_t disforge_recursive(const uint8_t *code, size_t code_size, const size_t *entries,
+                          size_t nentries, uint64_t *starts)
+{
+    return descend(code, code_size, 0, entries, nentries, starts, NULL);
+}
+
+// List code[from, to) as data, at most eight bytes per line (no records).
+static void list_data(struct disforge_sink *out, const uint8_t *code, size_t base,
+                      size_t from, size_t to)
+{
+    if (out->format == DISFORGE_RECORDS)
+        return;
+    while (from < to) {
+        size_t n = to - from < 8 ? to - from : 8;
+        disforge_sink_hex(out, base + from, 4);
+        disforge_sink_write(out, ": DB ", 5);
+        for (size_t k = 0; k < n; k++) {
+            if (k > 0)
+                disforge_sink_write(out, ", ", 2);
+            disforge_sink_write(out, "0x", 2);
+            disforge_sink_hex(out, code[from + k], 2);
+        }
+        disforge_sink_putc(out, '\n');
+        from += n;
+    }
+}
+
+/*
+ * disforge_disassemble_recursive() lists code in address order after a
+ * recursive descent from the entry offsets: the instructions found, and the
+ * bytes they do not cover as data. The instructions are those decoded by the
+ * descent, put into address order by their rank in the start bitmap. Returns
+ * -1 if out of memory.
+ */
+int disforge_disassemble_recursive(struct disforge_sink *out, const uint8_t *code, size_t code_size,
+                                   size_t base, const size_t *entries, size_t nentries)
+{
+    size_t words = (code_size + 63) / 64;
+    uint64_t *starts = malloc(words * sizeof(uint64_t) + 1);
+    size_t *rank = malloc(words * sizeof(size_t) + 1);
+    struct descent_insns kept = { 0 };
+    size_t *order = NULL;
+    int status = -1;
+
+    if (!starts || !rank ||
+        descend(code, code_size, base, entries, nentries, starts, &kept) == SIZE_MAX)
+        goto done;
+    order = malloc(kept.n * sizeof(size_t) + 1);
+    if (!order)
+        goto done;
+    for (size_t w = 0, n = 0; w < words; w++) {
+        rank[w] = n;
+        n += (size_t) __builtin_popcountll(starts[w]);
+    }
+    for (size_t k = 0; k < kept.n; k++) {
+        size_t i = kept.offset[k];
+        uint64_t below = starts[i / 64] & (((uint64_t) 1 << (i % 64)) - 1);
+        order[rank[i / 64] + (size_t) __builtin_popcountll(below)] = k;
+    }
+
+    size_t covered = 0;   // end of the instructions listed so far
+    for (size_t n = 0; n < kept.n; n++) {
+        const struct disforge_insn *insn = &kept.insn[order[n]];
+        size_t i = kept.offset[order[n]];
+
+        if (covered < i)
+            list_data(out, code, base, covered, i);
+        disforge_list_insn(out, insn, base + i);
+        size_t end = insn->length ? i + insn->length : code_size;
+        if (end > covered)
+            covered = end;
+    }
+    if (covered < code_size)
+        list_data(out, code, base, covered, code_size);
+    status = 0;
+
+done:
+    free(order);
+    free(kept.offset);
+    free(kept.insn);
+    free(rank);
+    free(starts);
+    return status;
+}
+
+/*
+ * Basic blocks and control-flow graph
+ *
+ * The CFG is built over the instructions found by recursive descent. A
+ * block starts at an entry point, a branch or call target, after a block
+ * terminator (RET, JMP, Jcc, LOOP*, JECXZ, invalid or truncated code) or
+ * after a gap, and ends just before the next block start. Where code
+ * overlaps (an instruction starts inside another one), the overlapping
+ * start and the fall-through successor of the instruction it cuts both
+ * start blocks, so the cut block keeps its fall-through edge. All arrays
+ * of a graph share one allocation; successor edges are kept in CSR form,
+ * the edges of block b being edge_to[edge_first[b] .. edge_first[b + 1] - 1].
+ * Calls do not end a block and get no edge, but their targets start one.
+ */
+
+// Whether the instruction ends its basic block.
+static inline int insn_ends_block(const struct disforge_insn *insn)
+{
+    return !insn_falls_through(insn) ||
+           (insn->op[0] == DISFORGE_OP_REL && insn->mnemonic != DISFORGE_MN_CALL);
+}
+
+// Index of the block starting at offset i, given the leader bitmap and its per-word ranks.
+static inline uint32_t cfg_block_of(const uint64_t *leaders, const uint32_t *rank, size_t i)
+{
+    uint64_t below = leaders[i / 64] & (((uint64_t) 1 << (i % 64)) - 1);
+    return rank[i / 64] + (uint32_t) __builtin_popcountll(below);
+}
+
+/*
+ * disforge_build_cfg() builds the CFG of the code reachable from the
+ * entry offsets. Returns 0, or -1 if out of memory. Release the graph
+ * with disforge_cfg_free().
+ */
+int disforge_build_cfg(const uint8_t *code, size_t code_size, const size_t *entries,
+                       size_t nentries, struct disforge_cfg *cfg)
+{
+    size_t words = (code_size + 63) / 64;
+    uint64_t *starts = malloc(2 * words * sizeof(uint64_t) + 1);
+    uint32_t *rank = malloc(words * sizeof(uint32_t) + 1);
+    struct disforge_insn insn;
+    size_t target;
+
+    memset(cfg, 0, sizeof(*cfg));
+    if (!starts || !rank ||
+        disforge_recursive(code, code_size, entries, nentries, starts) == SIZE_MAX)
+        goto fail;
+
+    // Pass 1: mark the block leaders.
+    uint64_t *leaders = starts + words;
+    memset(leaders, 0, words * sizeof(uint64_t));
+    for (size_t n = 0; n < nentries; n++)
+        if (entries[n] < code_size && bitmap_test(starts, entries[n]))
+            bitmap_set(leaders, entries[n]);
+    size_t prev_end = SIZE_MAX;
+    for (size_t w = 0; w < words; w++) {
+        for (uint64_t bits = starts[w]; bits; bits &= bits - 1) {
+            size_t i = w * 64 + (size_t) __builtin_ctzll(bits);
+            size_t len = disforge_decode_one(code + i, code_size - i, &insn);
+            if (i != prev_end) {
+                bitmap_set(leaders, i);
+                // i starts inside the previous instruction (overlapping code):
+                // that one's fall-through successor must start a block too.
+                if (i < prev_end && prev_end < code_size && bitmap_test(starts, prev_end))
+                    bitmap_set(leaders, prev_end);
+            }
+            if (insn_branch_target(&insn, i, &target) && target < code_size &&
+                bitmap_test(starts, target))
+                bitmap_set(leaders, target);
+            prev_end = i + len;
+            if (insn_ends_block(&insn) && prev_end < code_size && bitmap_test(starts, prev_end))
+                bitmap_set(leaders, prev_end);
+        }
+    }
+
+    uint32_t nblocks = 0;
+    for (size_t w = 0; w < words; w++) {
+        rank[w] = nblocks;
+        nblocks += (uint32_t) __builtin_popcountll(leaders[w]);
+    }
+
+    // One allocation for every array; each block has at most two successors.
+    size_t maxedges = 2 * (size_t) nblocks;
+    char *mem = malloc(2 * nblocks * sizeof(size_t) +
+                       (2 * (size_t) nblocks + 1 + maxedges) * sizeof(uint32_t) + maxedges);
+    if (!mem)
+        goto fail;
+    cfg->nblocks = nblocks;
+    cfg->block_start = (size_t *) mem;
+    cfg->block_end = cfg->block_start + nblocks;
+    cfg->block_insns = (uint32_t *)(cfg->block_end + nblocks);
+    cfg->edge_first = cfg->block_insns + nblocks;
+    cfg->edge_to = cfg->edge_first + nblocks + 1;
+    cfg->edge_kind = (uint8_t *)(cfg->edge_to + maxedges);
+
+    // Pass 2: fill in the blocks and their successors in address order.
+    uint32_t b = 0, e = 0;
+    for (size_t w = 0; w < words; w++) {
+        for (uint64_t bits = starts[w]; bits; bits &= bits - 1) {
+            size_t i = w * 64 + (size_t) __builtin_ctzll(bits);
+            size_t len = disforge_decode_one(code + i, code_size - i, &insn);
+            size_t end = len ? i + len : code_size;
+
+            if (bitmap_test(leaders, i)) {
+                b = cfg_block_of(leaders, rank, i);
+                cfg->block_start[b] = i;
+                cfg->block_insns[b] = 0;
+                cfg->edge_first[b] = e;
+            }
+            cfg->block_end[b] = end;
+            cfg->block_insns[b]++;
+
+            int next_is_leader = end < code_size && bitmap_test(leaders, end);
+            if (!insn_ends_block(&insn) && !next_is_leader &&
+                end < code_size && bitmap_test(starts, end))
+                continue;
+            if (insn.mnemonic != DISFORGE_MN_CALL && insn_branch_target(&insn, i, &target) &&
+                target < code_size && bitmap_test(starts, target)) {
+                cfg->edge_to[e] = cfg_block_of(leaders, rank, target);
+                cfg->edge_kind[e++] = DISFORGE_CFG_EDGE_TAKEN;
+            }
+            if (insn_falls_through(&insn) && next_is_leader) {
+                cfg->edge_to[e] = cfg_block_of(leaders, rank, end);
+                cfg->edge_kind[e++] = DISFORGE_CFG_EDGE_FALL;
+            }
+        }
+    }
+    cfg->edge_first[nblocks] = e;
+    cfg->nedges = e;
+
+    free(rank);
+    free(starts);
+    return 0;
+
+fail:
+    free(rank);
+    free(starts);
+    return -1;
+}
+
+void disforge_cfg_free(struct disforge_cfg *cfg)
+{
+    free(cfg->block_start);
+    memset(cfg, 0, sizeof(*cfg));
+}
+
+void disforge_block_iter_init(struct disforge_block_iter *it, const struct disforge_cfg *cfg,
+                              const uint8_t *code, size_t code_size, size_t base, uint32_t b)
+{
+    it->code = code;
+    it->code_size = code_size;
+    it->base = base;
+    it->offset = cfg->block_start[b];
+    it->end = cfg->block_end[b];
+}
+
+/*
+ * disforge_disassemble_cfg() lists the basic blocks of the code reachable
+ * from the entry offsets, each headed by its successors. Returns -1 if out
+ * of memory.
+ */
+int disforge_disassemble_cfg(struct disforge_sink *out, const uint8_t *code, size_t code_size,
+                             size_t base, const size_t *entries, size_t nentries)
+{
+    struct disforge_cfg cfg;
+    struct disforge_block_iter it;
+    struct disforge_insn insn;
+    size_t offset;
+    char num[16];
+
+    if (disforge_build_cfg(code, code_size, entries, nentries, &cfg) != 0)
+        return -1;
+    for (uint32_t b = 0; b < cfg.nblocks; b++) {
+        disforge_sink_puts(out, "\nBlock ");
+        disforge_sink_write(out, num, (size_t) snprintf(num, sizeof(num), "%" PRIu32, b));
+        disforge_sink_write(out, " (", 2);
+        disforge_sink_hex(out, base + cfg.block_start[b], 4);
+        disforge_sink_putc(out, ')');
+        for (uint32_t e = cfg.edge_first[b]; e < cfg.edge_first[b + 1]; e++) {
+            disforge_sink_puts(out, e == cfg.edge_first[b] ? " -> " : ", ");
+            disforge_sink_write(out, num,
+                                (size_t) snprintf(num, sizeof(num), "%" PRIu32, cfg.edge_to[e]));
+            if (cfg.edge_kind[e] == DISFORGE_CFG_EDGE_FALL)
+                disforge_sink_puts(out, " (fall-through)");
+        }
+        disforge_sink_write(out, ":\n", 2);
+        disforge_block_iter_init(&it, &cfg, code, code_size, base, b);
+        while (disforge_block_next(&it, &insn, &offset))
+            disforge_list_insn(out, &insn, base + offset);
+    }
+    disforge_cfg_free(&cfg);
+    return 0;
+}
+
+/*
+ * Streaming input
+ *
+ * A stream is listed chunk by chunk in bounded memory. An instruction that
+ * straddles a chunk boundary leaves its undecoded bytes in the stream's
+ * carry buffer and is decoded again once the next chunk supplies the rest,
+ * so the listing is identical to disassembling the concatenated input.
+ * disforge_decode_one() never looks at more than DISFORGE_STREAM_CARRY
+ * bytes to decide an instruction (14 prefixes, a two-byte opcode, ModR/M,
+ * SIB, disp32 and imm32), which bounds the carry.
+ */
+
+void disforge_stream_init(struct disforge_stream *st, size_t base)
+{
+    memset(st, 0, sizeof(*st));
+    st->base = base;
+}
+
+/*
+ * disforge_disassemble_stream() lists every instruction that is complete
+ * once chunk is appended to the stream, keeping a trailing partial
+ * instruction in the carry buffer.
+ */
+void disforge_disassemble_stream(struct disforge_sink *out, struct disforge_stream *st,
+                                 const uint8_t *chunk, size_t len)
+{
+    struct disforge_insn insn;
+    size_t used = 0;
+
+    if (st->done)
+        return;
+
+    // Finish instructions that began in an earlier chunk.
+    while (st->ncarry > 0) {
+        size_t take = DISFORGE_STREAM_CARRY - st->ncarry;
+        if (take > len - used)
+            take = len - used;
+        memcpy(st->carry + st->ncarry, chunk + used, take);
+        size_t n = disforge_decode_at(st->carry, st->ncarry + take, st->base + st->offset, &insn);
+        if (n == 0) {
+            // Still incomplete: everything left in the chunk is now carried.
+            st->ncarry += take;
+            return;
+        }
+        disforge_list_insn(out, &insn, st->base + st->offset);
+        st->offset += n;
+        if (n >= st->ncarry) {
+            used += n - st->ncarry;
+            st->ncarry = 0;
+        } else {
+            st->ncarry -= n;
+            memmove(st->carry, st->carry + n, st->ncarry);
+        }
+    }
+
+    while (used < len) {
+        size_t n = disforge_decode_at(chunk + used, len - used, st->base + st->offset, &insn);
+        if (n == 0) {
+            st->ncarry = len - used;
+            memcpy(st->carry, chunk + used, st->ncarry);
+            return;
+        }
+        disforge_list_insn(out, &insn, st->base + st->offset);
+        st->offset += n;
+        used += n;
+    }
+}
+
+// End of input: report an instruction left incomplete in the carry buffer.
+void disforge_disassemble_stream_end(struct disforge_sink *out, struct disforge_stream *st)
+{
+    struct disforge_insn insn;
+
+    if (st->done || st->ncarry == 0)
+        return;
+    disforge_decode_at(st->carry, st->ncarry, st->base + st->offset, &insn);
+    disforge_list_insn(out, &insn, st->base + st->offset);
+    st->done = 1;
+}
+
+/*
+ * Instruction-boundary index
+ *
+ * An index records where the instructions of a linear sweep start, so a
+ * listing can begin anywhere in a large image without rescanning it from
+ * byte 0. Every interval-th instruction start is a checkpoint. The
+ * checkpoints are stored as LEB128 deltas from the previous one, and every
+ * INDEX_BLOCK_LEN-th checkpoint also gets an entry in a block table with
+ * its absolute offset and the position of the next delta, so a seek is a
+ * binary search over the block table, at most INDEX_BLOCK_LEN - 1 deltas,
+ * and fewer than interval instructions of length-only decoding.
+ *
+ * The sidecar file is the header, the block table and the deltas in host
+ * byte order; disforge_index_load() checks it and then uses it in place.
+ */
+
+#define INDEX_MAGIC "DFINDEX2"
+#define INDEX_BLOCK_LEN 64
+
+static inline size_t index_nblocks(const struct disforge_index_header *hdr)
+{
+    return (size_t)((hdr->ncheckpoints + hdr->block_len - 1) / hdr->block_len);
+}
+
+// Read one LEB128 value before end; UINT64_MAX if it is cut off or too long.
+static inline uint64_t leb128_get(const uint8_t **p, const uint8_t *end)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    uint8_t b;
+
+    do {
+        if (*p == end || shift > 63)
+            return UINT64_MAX;
+        b = *(*p)++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+void disforge_index_free(struct disforge_index *idx)
+{
+    if (idx->map) {
+        munmap(idx->map, idx->map_size);
+    } else {
+        free(idx->blocks);
+        free(idx->deltas);
+    }
+    memset(idx, 0, sizeof(*idx));
+}
+
+/*
+ * disforge_index_build() indexes a linear sweep over code, with a
+ * checkpoint every interval instructions. Returns 0, or -1 if out of
+ * memory.
+ */
+int disforge_index_build(const uint8_t *code, size_t code_size, uint32_t interval,
+                         struct disforge_index *idx)
+{
+    struct len_window win;
+    size_t cap_blocks = 64, cap_deltas = 4096;
+    uint64_t prev = 0, n = 0;
+    size_t i = 0;
+
+    memset(idx, 0, sizeof(*idx));
+    memcpy(idx->hdr.magic, INDEX_MAGIC, sizeof(idx->hdr.magic));
+    idx->hdr.code_size = code_size;
+    idx->hdr.interval = interval;
+    idx->hdr.block_len = INDEX_BLOCK_LEN;
+    idx->blocks = malloc(cap_blocks * sizeof(*idx->blocks));
+    idx->deltas = malloc(cap_deltas);
+    if (!idx->blocks || !idx->deltas)
+        goto fail;
+
+    len_window_init(&win);
+    while (i < code_size) {
+        if (n % interval == 0) {
+            uint64_t k = idx->hdr.ncheckpoints++;
+            if (k % INDEX_BLOCK_LEN == 0) {
+                if (k / INDEX_BLOCK_LEN == cap_blocks) {
+                    void *grown = realloc(idx->blocks, 2 * cap_blocks * sizeof(*idx->blocks));
+                    if (!grown)
+                        goto fail;
+                    idx->blocks = grown;
+                    cap_blocks *= 2;
+                }
+                idx->blocks[k / INDEX_BLOCK_LEN].offset = i;
+                idx->blocks[k / INDEX_BLOCK_LEN].pos = idx->hdr.delta_bytes;
+            } else {
+                if (cap_deltas - idx->hdr.delta_bytes < 10) {
+                    void *grown = realloc(idx->deltas, 2 * cap_deltas);
+                    if (!grown)
+                        goto fail;
+                    idx->deltas = grown;
+                    cap_deltas *= 2;
+                }
+                uint64_t d = i - prev;
+                uint8_t *p = idx->deltas + idx->hdr.delta_bytes;
+                for (; d >= 0x80; d >>= 7)
+                    *p++ = (uint8_t)(d | 0x80);
+                *p++ = (uint8_t) d;
+                idx->hdr.delta_bytes = (uint64_t)(p - idx->deltas);
+            }
+            prev = i;
+        }
+        n++;
+        size_t len = len_window_length(&win, code, code_size, i);
+        if (len == 0)
+            break;
+        i += len;
+    }
+    return 0;
+
+fail:
+    disforge_index_free(idx);
+    return -1;
+}
+
+// Write the index to fd. Returns 0 or an errno value.
+int disforge_index_write(const struct disforge_index *idx, int fd)
+{
+    int err = write_all(fd, (const char *) &idx->hdr, sizeof(idx->hdr));
+    if (!err)
+        err = write_all(fd, (const char *) idx->blocks,
+                        index_nblocks(&idx->hdr) * sizeof(*idx->blocks));
+    if (!err)
+        err = write_all(fd, (const char *) idx->deltas, idx->hdr.delta_bytes);
+    return err;
+}
+
+/*
+ * index_check() validates the block table of a mapped index against its
+ * header: block 0 starts at 0, offsets increase and stay inside the input,
+ * and delta positions increase and stay inside the delta area.
+ */
+static int index_check(const struct disforge_index_header *hdr,
+                       const struct disforge_index_block *blocks, size_t nblocks)
+{
+    for (size_t b = 0; b < nblocks; b++) {
+        if (blocks[b].offset >= hdr->code_size || blocks[b].pos > hdr->delta_bytes)
+            return -1;
+        if (b == 0 ? blocks[b].offset != 0 || blocks[b].pos != 0
+                   : blocks[b].offset <= blocks[b - 1].offset || blocks[b].pos < blocks[b - 1].pos)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * disforge_index_load() maps the index sidecar at path for an input of
+ * code_size bytes identified by fingerprint. Returns 0, an errno value if
+ * path cannot be mapped, DISFORGE_INDEX_INVALID for a malformed file, or
+ * DISFORGE_INDEX_STALE (with idx->hdr read) if it was built for an input
+ * of another size or fingerprint.
+ */
+int disforge_index_load(struct disforge_index *idx, const char *path, size_t code_size,
+                        uint64_t fingerprint)
+{
+    struct stat st;
+    int err = DISFORGE_INDEX_INVALID;
+
+    memset(idx, 0, sizeof(*idx));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno;
+    if (fstat(fd, &st) != 0) {
+        err = errno;
+        close(fd);
+        return err;
+    }
+    size_t size = (size_t) st.st_size;
+    if (size < sizeof(idx->hdr)) {
+        close(fd);
+        return DISFORGE_INDEX_INVALID;
+    }
+    const uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return errno;
+
+    memcpy(&idx->hdr, map, sizeof(idx->hdr));
+    if (memcmp(idx->hdr.magic, INDEX_MAGIC, sizeof(idx->hdr.magic)) != 0 ||
+        idx->hdr.interval == 0 || idx->hdr.block_len == 0)
+        goto fail;
+    size_t nblocks = index_nblocks(&idx->hdr);
+    if (idx->hdr.ncheckpoints > size || idx->hdr.delta_bytes > size ||
+        sizeof(idx->hdr) + nblocks * sizeof(*idx->blocks) + idx->hdr.delta_bytes != size)
+        goto fail;
+    const struct disforge_index_block *blocks = (const void *)(map + sizeof(idx->hdr));
+    if (index_check(&idx->hdr, blocks, nblocks))
+        goto fail;
+    if (idx->hdr.code_size != code_size || idx->hdr.fingerprint != fingerprint) {
+        err = DISFORGE_INDEX_STALE;
+        goto fail;
+    }
+    madvise((void *) map, size, MADV_RANDOM);
+    idx->map = (void *) map;
+    idx->map_size = size;
+    idx->blocks = (struct disforge_index_block *)(map + sizeof(idx->hdr));
+    idx->deltas = (uint8_t *)(idx->blocks + nblocks);
+    return 0;
+
+fail:
+    munmap((void *) map, size);
+    return err;
+}
+
+// Offset of the last checkpoint at or before offset.
+size_t disforge_index_checkpoint(const struct disforge_index *idx, size_t offset)
+{
+    size_t nblocks = index_nblocks(&idx->hdr);
+
+    if (nblocks == 0)
+        return 0;
+
+    // Last block starting at or before offset; block 0 starts at 0.
+    size_t lo = 0, hi = nblocks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->blocks[mid].offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    // Walk the block's deltas to the last checkpoint at or before offset.
+    size_t p = (size_t) idx->blocks[lo].offset;
+    if (p > offset)
+        return 0;
+    const uint8_t *d = idx->deltas + idx->blocks[lo].pos;
+    const uint8_t *end = idx->deltas +
+        (lo + 1 < nblocks ? idx->blocks[lo + 1].pos : idx->hdr.delta_bytes);
+    uint64_t left = idx->hdr.ncheckpoints - (uint64_t) lo * idx->hdr.block_len - 1;
+    if (left > idx->hdr.block_len - 1)
+        left = idx->hdr.block_len - 1;
+    while (left-- > 0) {
+        uint64_t delta = leb128_get(&d, end);
+        if (delta > offset - p)
+            break;
+        p += (size_t) delta;
+    }
+    return p;
+}
+
+/*
+ * disforge_insn_covering() decodes lengths from the instruction boundary
+ * at from up to the instruction that covers offset and returns its start.
+ */
+size_t disforge_insn_covering(const uint8_t *code, size_t code_size, size_t from, size_t offset)
+{
+    size_t p = from;
+    for (;;) {
+        size_t len = disforge_insn_length(code + p, code_size - p);
+        if (len == 0 || p + len > offset)
+            return p;
+        p += len;
+    }
+}
+
+/*
+ * disforge_index_seek() returns the start of the instruction of the
+ * linear sweep that covers offset (code_size if offset is past the end),
+ * decoding forward from the nearest checkpoint at or before offset.
+ */
+size_t disforge_index_seek(const struct disforge_index *idx, const uint8_t *code,
+                           size_t code_size, size_t offset)
+{
+    if (offset >= code_size)
+        return code_size;
+    return disforge_insn_covering(code, code_size, disforge_index_checkpoint(idx, offset), offset);
+}
+
+/*
+ * Columnar export
+ *
+ * --columns writes the decoded instructions of a linear sweep as one
+ * contiguous array per field, so an analysis that scans a single
+ * attribute (mnemonics, branch targets, base registers...) reads only that
+ * array. The file starts with struct columns_header and a directory of
+ * struct column_entry, one per column, giving its name, element size and
+ * file offset; every column starts on a COLUMNS_ALIGN boundary so a mapped
+ * file can be scanned with aligned vector loads. Element i of every column
+ * describes instruction i. Everything is in host byte order.
+ *
+ * The file is sized from a length-only counting pass and filled through a
+ * shared mapping, so no column is ever buffered in memory.
+ */
+
+#define COLUMNS_MAGIC "DFCOLUMN"
+#define COLUMNS_VERSION 1
+#define COLUMNS_ALIGN 64
+
+enum column {
+    COL_ADDRESS, COL_LENGTH, COL_MNEMONIC, COL_PREFIXES, COL_FLAGS,
+    COL_OPCODE, COL_OPCODE2, COL_MODRM, COL_OP0, COL_OP1, COL_REG0, COL_REG1,
+    COL_BASE, COL_INDEX, COL_SCALE, COL_COND, COL_DISP, COL_IMM, COL_TARGET,
+    COL_COUNT
+};
+
+static const struct {
+    char     name[16];
+    uint32_t size;
+} column_desc[COL_COUNT] = {
+    [COL_ADDRESS]  = {"address", 8},
+    [COL_LENGTH]   = {"length", 1},      // 0 for a truncated instruction
+    [COL_MNEMONIC] = {"mnemonic", 1},
+    [COL_PREFIXES] = {"prefixes", 1},
+    [COL_FLAGS]    = {"flags", 1},
+    [COL_OPCODE]   = {"opcode", 1},
+    [COL_OPCODE2]  = {"opcode2", 1},
+    [COL_MODRM]    = {"modrm", 1},
+    [COL_OP0]      = {"op0", 1},
+    [COL_OP1]      = {"op1", 1},
+    [COL_REG0]     = {"reg0", 1},
+    [COL_REG1]     = {"reg1", 1},
+    [COL_BASE]     = {"base", 1},
+    [COL_INDEX]    = {"index", 1},
+    [COL_SCALE]    = {"scale", 1},
+    [COL_COND]     = {"cond", 1},
+    [COL_DISP]     = {"disp", 4},
+    [COL_IMM]      = {"imm", 4},
+    [COL_TARGET]   = {"target", 4},      // 0 unless op0 is a relative branch
+};
+
+struct columns_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t ncolumns;
+    uint64_t count;           // instructions, i.e. elements per column
+};
+
+struct column_entry {
+    char     name[16];
+    uint32_t elem_size;
+    uint32_t reserved;
+    uint64_t offset;          // file offset of the column
+};
+
+/*
+ * disforge_export_columns() writes the columnar file for a linear sweep
+ * over code, loaded at base, to fd (a regular file, which is resized).
+ * Returns 0 or an errno value.
+ */
+int disforge_export_columns(const uint8_t *code, size_t code_size, size_t base, int fd)
+{
+    struct len_window win;
+    size_t count = 0;
+
+    len_window_init(&win);
+    for (size_t i = 0; i < code_size; ) {
+        count++;
+        size_t len = len_window_length(&win, code, code_size, i);
+        if (len == 0)
+            break;
+        i += len;
+    }
+
+    struct columns_header hdr = {
+        .magic = COLUMNS_MAGIC,
+        .version = COLUMNS_VERSION,
+        .ncolumns = COL_COUNT,
+        .count = count,
+    };
+    struct column_entry dir[COL_COUNT];
+    size_t size = sizeof(hdr) + sizeof(dir);
+    for (int c = 0; c < COL_COUNT; c++) {
+        size = (size + COLUMNS_ALIGN - 1) & ~(size_t)(COLUMNS_ALIGN - 1);
+        memset(&dir[c], 0, sizeof(dir[c]));
+        memcpy(dir[c].name, column_desc[c].name, sizeof(dir[c].name));
+        dir[c].elem_size = column_desc[c].size;
+        dir[c].offset = size;
+        size += count * column_desc[c].size;
+    }
+
+    // Allocate the blocks now: running out of space later would be a SIGBUS.
+    int err = posix_fallocate(fd, 0, (off_t) size);
+    if (err)
+        return err;
+    uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return errno;
+    memcpy(map, &hdr, sizeof(hdr));
+    memcpy(map + sizeof(hdr), dir, sizeof(dir));
+
+    uint8_t *col[COL_COUNT];
+    for (int c = 0; c < COL_COUNT; c++)
+        col[c] = map + dir[c].offset;
+    struct disforge_insn_array cols = {
+        .address = (uint64_t *) col[COL_ADDRESS],
+        .length = col[COL_LENGTH],
+        .mnemonic = col[COL_MNEMONIC],
+        .prefixes = col[COL_PREFIXES],
+        .flags = col[COL_FLAGS],
+        .opcode = col[COL_OPCODE],
+        .opcode2 = col[COL_OPCODE2],
+        .modrm = col[COL_MODRM],
+        .op = {col[COL_OP0], col[COL_OP1]},
+        .op_reg = {col[COL_REG0], col[COL_REG1]},
+        .base = col[COL_BASE],
+        .index = col[COL_INDEX],
+        .scale = col[COL_SCALE],
+        .cond = col[COL_COND],
+        .disp = (int32_t *) col[COL_DISP],
+        .imm = (uint32_t *) col[COL_IMM],
+        .target = (uint32_t *) col[COL_TARGET],
+    };
+
+    size_t i = disforge_decode_batch(code, code_size, base, &cols, count);
+    if (cols.count < count) {
+        // The truncated last instruction, stored with length 0.
+        struct disforge_insn insn;
+        disforge_decode_at(code + i, code_size - i, base + i, &insn);
+        insn_array_store(&cols, cols.count, &insn, base + i);
+    }
+
+    munmap(map, size);
+    return 0;
+}
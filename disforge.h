@@ -0,0 +1,450 @@
+/*
+ * libdisforge: an x86 (i386) disassembler library.
+ *
+ * The library keeps no mutable global state (apart from the length tables
+ * it fills once at load time and, in -DDISFORGE_STATS builds, the decoder
+ * counters), so any number of threads can disassemble different buffers
+ * at the same time as long as each uses its own sink, stream, index or
+ * context. Nothing here prints diagnostics; failures are returned.
+ */
+#ifndef DISFORGE_H
+#define DISFORGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Output sink
+ *
+ * Text is collected in a caller-owned buffer and handed to the kernel with
+ * a single write(2) (or, for a callback sink, to the caller's write
+ * function) whenever the buffer fills up or disforge_sink_flush() is called.
+ * The first write error is latched in error and later output is dropped.
+ * The buffer must hold at least DISFORGE_SINK_MIN_CAP bytes.
+ *
+ * A memory sink (fd == DISFORGE_SINK_MEMORY, see disforge_sink_init_mem())
+ * owns a heap buffer that grows instead of being flushed, for text that is
+ * produced ahead of the point where it can be written. An asynchronous sink
+ * (disforge_sink_init_async()) double-buffers and writes one half through
+ * io_uring while the other fills.
+ *
+ * format selects what the listing functions write into the sink: text
+ * lines, or fixed-width binary records (see struct disforge_record).
+ */
+
+// Write callback of a sink: consume all len bytes, return 0 or an errno value.
+typedef int (*disforge_sink_write_fn)(void *user, const char *data, size_t len);
+
+struct disforge_sink {
+    int    fd;
+    char  *buf;
+    size_t len;
+    size_t cap;
+    int    error;
+    int    format;   // enum disforge_format
+    disforge_sink_write_fn write;       // fd == DISFORGE_SINK_CALLBACK only
+    void  *user;                        // passed to write
+    struct disforge_sink_async *async;  // disforge_sink_init_async() sinks only
+};
+
+enum disforge_format {
+    DISFORGE_TEXT,
+    DISFORGE_RECORDS,
+};
+
+#define DISFORGE_SINK_MIN_CAP  64
+#define DISFORGE_SINK_MEMORY   (-1)
+#define DISFORGE_SINK_CALLBACK (-2)
+
+void disforge_sink_init(struct disforge_sink *out, int fd, char *buf, size_t cap);
+void disforge_sink_init_fn(struct disforge_sink *out, char *buf, size_t cap,
+                           disforge_sink_write_fn write, void *user);
+int  disforge_sink_init_mem(struct disforge_sink *out, size_t cap);
+void disforge_sink_free_mem(struct disforge_sink *out);
+int  disforge_sink_init_async(struct disforge_sink *out, int fd, char *buf, size_t cap);
+int  disforge_sink_async_active(const struct disforge_sink *out);
+void disforge_sink_free_async(struct disforge_sink *out);
+void disforge_sink_reopen(struct disforge_sink *out, int fd);
+int  disforge_sink_flush(struct disforge_sink *out);
+int  disforge_sink_make_room(struct disforge_sink *out, size_t n);
+void disforge_sink_write_through(struct disforge_sink *out, const char *s, size_t n);
+void disforge_sink_hex(struct disforge_sink *out, uint64_t value, int min_digits);
+
+static inline void disforge_sink_write(struct disforge_sink *out, const char *s, size_t n)
+{
+    if (out->len + n > out->cap && disforge_sink_make_room(out, n) != 0) {
+        // Larger than the whole buffer: hand it to the writer directly.
+        disforge_sink_write_through(out, s, n);
+        return;
+    }
+    memcpy(out->buf + out->len, s, n);
+    out->len += n;
+}
+
+static inline void disforge_sink_putc(struct disforge_sink *out, char c)
+{
+    if (out->len == out->cap)
+        disforge_sink_make_room(out, 1);
+    out->buf[out->len++] = c;
+}
+
+static inline void disforge_sink_puts(struct disforge_sink *out, const char *s)
+{
+    disforge_sink_write(out, s, strlen(s));
+}
+
+/*
+ * Decoded instructions
+ */
+
+#define DISFORGE_MAX_INSN_LEN 15   // architectural limit, prefixes included
+
+// Mnemonic ids used by the opcode descriptor tables.
+enum disforge_mnemonic {
+    DISFORGE_MN_INVALID,
+    DISFORGE_MN_ADD, DISFORGE_MN_OR, DISFORGE_MN_ADC, DISFORGE_MN_SBB,
+    DISFORGE_MN_AND, DISFORGE_MN_SUB, DISFORGE_MN_XOR, DISFORGE_MN_CMP,
+    DISFORGE_MN_MOV, DISFORGE_MN_MOVZX, DISFORGE_MN_MOVSX, DISFORGE_MN_LEA,
+    DISFORGE_MN_XCHG, DISFORGE_MN_TEST,
+    DISFORGE_MN_INC, DISFORGE_MN_DEC, DISFORGE_MN_PUSH, DISFORGE_MN_POP,
+    DISFORGE_MN_ROL, DISFORGE_MN_ROR, DISFORGE_MN_RCL, DISFORGE_MN_RCR,
+    DISFORGE_MN_SHL, DISFORGE_MN_SHR, DISFORGE_MN_SAL, DISFORGE_MN_SAR,
+    DISFORGE_MN_NOT, DISFORGE_MN_NEG, DISFORGE_MN_MUL, DISFORGE_MN_IMUL,
+    DISFORGE_MN_DIV, DISFORGE_MN_IDIV,
+    DISFORGE_MN_JCC, DISFORGE_MN_JMP, DISFORGE_MN_CALL,
+    DISFORGE_MN_LOOPNZ, DISFORGE_MN_LOOPZ, DISFORGE_MN_LOOP, DISFORGE_MN_JECXZ,
+    DISFORGE_MN_RET, DISFORGE_MN_NOP, DISFORGE_MN_INT3,
+    DISFORGE_MN_MOVSB, DISFORGE_MN_MOVSD, DISFORGE_MN_CMPSB, DISFORGE_MN_CMPSD,
+    DISFORGE_MN_STOSB, DISFORGE_MN_STOSD, DISFORGE_MN_LODSB, DISFORGE_MN_LODSD,
+    DISFORGE_MN_SCASB, DISFORGE_MN_SCASD,
+    DISFORGE_MN_LOCK, DISFORGE_MN_REPNZ, DISFORGE_MN_REP,
+    DISFORGE_MN_COUNT
+};
+
+// Prefix bits in disforge_insn.prefixes, in the order of DISFORGE_MN_LOCK...
+#define DISFORGE_PFX_LOCK  0x01
+#define DISFORGE_PFX_REPNZ 0x02
+#define DISFORGE_PFX_REP   0x04
+
+// Flag bits in disforge_insn.flags
+#define DISFORGE_INSN_MODRM    0x01  // a ModR/M byte was decoded
+#define DISFORGE_INSN_SIB      0x02  // a SIB byte was decoded
+#define DISFORGE_INSN_DISP     0x04  // the memory operand carries a displacement
+#define DISFORGE_INSN_BYTE_PTR 0x08  // the r/m operand is a byte access
+
+// What each operand of a decoded instruction refers to.
+enum disforge_operand_kind {
+    DISFORGE_OP_NONE,
+    DISFORGE_OP_REG,   // general-purpose register op_reg[n]
+    DISFORGE_OP_MEM,   // memory at [base + index*scale + disp]
+    DISFORGE_OP_IMM,   // the immediate value
+    DISFORGE_OP_REL,   // relative branch, displacement in imm
+    DISFORGE_OP_ONE,   // the constant 1 (shift by one)
+    DISFORGE_OP_CL,    // the CL register (shift count)
+};
+
+#define DISFORGE_REG_NONE 0xFF
+
+/*
+ * struct disforge_insn is the compact binary form of one instruction, filled
+ * by disforge_decode_at() or disforge_decode_one(). It holds everything the
+ * printer needs, so callers that only want lengths or branch targets never
+ * touch text.
+ */
+struct disforge_insn {
+    uint8_t  length;      // total length in bytes, prefixes included
+    uint8_t  mnemonic;    // enum disforge_mnemonic
+    uint8_t  prefixes;    // DISFORGE_PFX_* bits
+    uint8_t  flags;       // DISFORGE_INSN_* bits
+    uint8_t  opcode;      // first opcode byte (0x0F for two-byte opcodes)
+    uint8_t  opcode2;     // second byte of a 0x0F xx opcode
+    uint8_t  modrm;
+    uint8_t  imm_size;    // immediate or relative displacement size in bytes
+    uint8_t  op[2];       // enum disforge_operand_kind, destination first
+    uint8_t  op_reg[2];   // register number of DISFORGE_OP_REG operands
+    uint8_t  base;        // memory base register, DISFORGE_REG_NONE if absent
+    uint8_t  index;       // memory index register, DISFORGE_REG_NONE if absent
+    uint8_t  scale;       // index scale factor (1, 2, 4 or 8)
+    uint8_t  cond;        // condition code of DISFORGE_MN_JCC
+    int32_t  disp;        // memory displacement
+    uint32_t imm;         // immediate; relative displacements are sign-extended
+    uint32_t target;      // absolute target address of an DISFORGE_OP_REL branch
+};
+
+size_t disforge_decode_at(const uint8_t *code, size_t code_size, size_t address,
+                          struct disforge_insn *insn);
+
+// disforge_decode_at() for code loaded at address 0.
+static inline size_t disforge_decode_one(const uint8_t *code, size_t code_size,
+                                         struct disforge_insn *insn)
+{
+    return disforge_decode_at(code, code_size, 0, insn);
+}
+
+const char *disforge_mnemonic_name(unsigned mnemonic);
+
+/*
+ * struct disforge_insn_array is a caller-owned structure of arrays filled
+ * by disforge_decode_batch(): element n of every array describes
+ * instruction n, with the same meaning as the struct disforge_insn field
+ * of the same name (op and op_reg split into one array per operand).
+ * Arrays left NULL are skipped, so a caller pays only for the fields it
+ * reads.
+ */
+struct disforge_insn_array {
+    uint64_t *address;
+    uint8_t  *length;
+    uint8_t  *mnemonic;
+    uint8_t  *prefixes;
+    uint8_t  *flags;
+    uint8_t  *opcode;
+    uint8_t  *opcode2;
+    uint8_t  *modrm;
+    uint8_t  *op[2];
+    uint8_t  *op_reg[2];
+    uint8_t  *base;
+    uint8_t  *index;
+    uint8_t  *scale;
+    uint8_t  *cond;
+    int32_t  *disp;
+    uint32_t *imm;
+    uint32_t *target;
+    size_t    count;      // instructions stored by the last call
+};
+
+size_t disforge_decode_batch(const uint8_t *code, size_t code_size, size_t base,
+                             struct disforge_insn_array *insns, size_t max);
+
+size_t disforge_insn_length(const uint8_t *code, size_t code_size);
+size_t disforge_find_boundaries(const uint8_t *code, size_t code_size, uint64_t *bitmap);
+size_t disforge_find_offsets(const uint8_t *code, size_t code_size, size_t *offsets, size_t max,
+                             size_t *next);
+size_t disforge_insn_covering(const uint8_t *code, size_t code_size, size_t from, size_t offset);
+
+/*
+ * Callback interface
+ *
+ * A context describes one linear sweep: where the code is loaded and the
+ * function that receives each decoded instruction. It is read-only during
+ * disforge_walk(), so one context may drive several walks at once.
+ */
+
+// Called for every instruction of a walk; a nonzero return stops it.
+typedef int (*disforge_insn_fn)(void *user, const struct disforge_insn *insn, size_t address);
+
+struct disforge_ctx {
+    size_t           base;      // address of code[0]
+    disforge_insn_fn insn_fn;
+    void            *user;      // passed to insn_fn
+};
+
+size_t disforge_walk(const struct disforge_ctx *ctx, const uint8_t *code, size_t code_size);
+
+/*
+ * Formatting and listings
+ */
+
+void   disforge_print_insn(struct disforge_sink *out, const struct disforge_insn *insn);
+void   disforge_list_header(struct disforge_sink *out, const char *title, const char *name);
+void   disforge_list_insn(struct disforge_sink *out, const struct disforge_insn *insn,
+                          size_t address);
+size_t disforge_disassemble_line(struct disforge_sink *out, const uint8_t *code,
+                                 size_t code_size, size_t base, size_t i);
+void   disforge_disassemble(struct disforge_sink *out, const uint8_t *code, size_t code_size,
+                            size_t base);
+void   disforge_disassemble_parallel(struct disforge_sink *out, const uint8_t *code,
+                                     size_t code_size, size_t base, int nthreads);
+void   disforge_disassemble_pipelined(struct disforge_sink *out, const uint8_t *code,
+                                      size_t code_size, size_t base, int nformatters);
+
+/*
+ * Binary records
+ *
+ * With DISFORGE_RECORDS the listing functions write a stream of
+ * fixed-width records instead of text: struct disforge_record_header,
+ * names_size bytes of names (the NUL-terminated mnemonic names indexed by
+ * mnemonic id, then the register names indexed by register number,
+ * zero-padded to a multiple of 8 bytes), then one struct disforge_record
+ * per instruction up to the end of the stream. All fields are in host
+ * byte order; byte_order reads 0x0102 when that matches the reader.
+ */
+
+#define DISFORGE_RECORD_MAGIC "DFRECORD"
+#define DISFORGE_RECORD_VERSION 1
+
+struct disforge_record_header {
+    char     magic[8];
+    uint16_t version;
+    uint16_t byte_order;      // 0x0102
+    uint16_t record_size;     // sizeof(struct disforge_record)
+    uint16_t mnemonic_count;
+    uint16_t register_count;
+    uint16_t reserved;
+    uint32_t names_size;      // bytes of names between the header and the records
+};
+
+struct disforge_record {
+    uint64_t address;
+    uint8_t  length;          // 0 for an instruction truncated by the end of the input
+    uint8_t  mnemonic;        // index into the mnemonic names
+    uint8_t  prefixes;        // DISFORGE_PFX_* bits
+    uint8_t  flags;           // DISFORGE_INSN_* bits
+    uint8_t  op[2];           // enum disforge_operand_kind, destination first
+    uint8_t  op_reg[2];       // register number of DISFORGE_OP_REG operands
+    uint8_t  base;            // memory base register, DISFORGE_REG_NONE if absent
+    uint8_t  index;           // memory index register, DISFORGE_REG_NONE if absent
+    uint8_t  scale;
+    uint8_t  cond;            // condition code of a Jcc
+    uint8_t  opcode;
+    uint8_t  opcode2;
+    uint8_t  modrm;
+    uint8_t  imm_size;
+    int32_t  disp;            // memory displacement
+    uint32_t value;           // branch target for DISFORGE_OP_REL, the immediate otherwise
+};
+
+/*
+ * Recursive descent and control-flow graph
+ */
+
+size_t disforge_recursive(const uint8_t *code, size_t code_size, const size_t *entries,
+                          size_t nentries, uint64_t *starts);
+int disforge_disassemble_recursive(struct disforge_sink *out, const uint8_t *code, size_t code_size,
+                                   size_t base, const size_t *entries, size_t nentries);
+
+enum disforge_cfg_edge_kind {
+    DISFORGE_CFG_EDGE_FALL,    // fall-through to the next instruction
+    DISFORGE_CFG_EDGE_TAKEN,   // taken relative branch
+};
+
+struct disforge_cfg {
+    uint32_t  nblocks;
+    uint32_t  nedges;
+    size_t   *block_start;   // offset of the block's first instruction
+    size_t   *block_end;     // offset just past its last instruction
+    uint32_t *block_insns;   // number of instructions
+    uint32_t *edge_first;    // nblocks + 1 indices into the edge arrays
+    uint32_t *edge_to;       // successor block
+    uint8_t  *edge_kind;     // enum disforge_cfg_edge_kind
+};
+
+int  disforge_build_cfg(const uint8_t *code, size_t code_size, const size_t *entries,
+                        size_t nentries, struct disforge_cfg *cfg);
+void disforge_cfg_free(struct disforge_cfg *cfg);
+int  disforge_disassemble_cfg(struct disforge_sink *out, const uint8_t *code, size_t code_size,
+                              size_t base, const size_t *entries, size_t nentries);
+
+/*
+ * Block iteration: walks the instructions of one basic block.
+ *
+ *     struct disforge_block_iter it;
+ *     disforge_block_iter_init(&it, cfg, code, code_size, base, b);
+ *     while (disforge_block_next(&it, &insn, &offset))
+ *         ...
+ */
+struct disforge_block_iter {
+    const uint8_t *code;
+    size_t code_size;
+    size_t base;      // address of code[0]
+    size_t offset;
+    size_t end;
+};
+
+void disforge_block_iter_init(struct disforge_block_iter *it, const struct disforge_cfg *cfg,
+                              const uint8_t *code, size_t code_size, size_t base, uint32_t b);
+
+// Decode the next instruction of the block; returns 0 past its end.
+static inline int disforge_block_next(struct disforge_block_iter *it, struct disforge_insn *insn,
+                                      size_t *offset)
+{
+    if (it->offset >= it->end)
+        return 0;
+    *offset = it->offset;
+    size_t len = disforge_decode_at(it->code + it->offset, it->code_size - it->offset,
+                                    it->base + it->offset, insn);
+    it->offset = len ? it->offset + len : it->end;
+    return 1;
+}
+
+/*
+ * Streaming input
+ */
+
+#define DISFORGE_STREAM_CARRY 32
+
+struct disforge_stream {
+    size_t  base;                            // address of the first byte
+    size_t  offset;                          // stream offset of carry[0] / the next chunk
+    size_t  ncarry;
+    uint8_t carry[DISFORGE_STREAM_CARRY];
+    int     done;                            // a truncated instruction ended the listing
+};
+
+void disforge_stream_init(struct disforge_stream *st, size_t base);
+void disforge_disassemble_stream(struct disforge_sink *out, struct disforge_stream *st,
+                                 const uint8_t *chunk, size_t len);
+void disforge_disassemble_stream_end(struct disforge_sink *out, struct disforge_stream *st);
+
+/*
+ * Instruction-boundary index
+ */
+
+#define DISFORGE_INDEX_DEFAULT_INTERVAL 256
+
+// disforge_index_load() failures besides errno values
+#define DISFORGE_INDEX_INVALID (-1)   // not a disforge index
+#define DISFORGE_INDEX_STALE   (-2)   // built for an input of another size or fingerprint
+
+/*
+ * The fingerprint identifies the indexed input beyond its size. The caller
+ * sets it before disforge_index_write() and passes the same value to
+ * disforge_index_load(); the CLI uses the input's modification time.
+ */
+struct disforge_index_header {
+    char     magic[8];
+    uint64_t code_size;       // size of the indexed input
+    uint64_t fingerprint;     // identifies the indexed input, 0 if unused
+    uint32_t interval;        // instructions between checkpoints
+    uint32_t block_len;       // checkpoints per block table entry
+    uint64_t ncheckpoints;
+    uint64_t delta_bytes;
+};
+
+struct disforge_index_block {
+    uint64_t offset;          // offset of checkpoint b * block_len
+    uint64_t pos;             // position of the following delta in deltas
+};
+
+struct disforge_index {
+    struct disforge_index_header  hdr;
+    struct disforge_index_block  *blocks;
+    uint8_t             *deltas;
+    void                *map;         // the sidecar mapping, NULL if built in memory
+    size_t               map_size;
+};
+
+int    disforge_index_build(const uint8_t *code, size_t code_size, uint32_t interval,
+                            struct disforge_index *idx);
+int    disforge_index_write(const struct disforge_index *idx, int fd);
+int    disforge_index_load(struct disforge_index *idx, const char *path, size_t code_size,
+                           uint64_t fingerprint);
+void   disforge_index_free(struct disforge_index *idx);
+size_t disforge_index_checkpoint(const struct disforge_index *idx, size_t offset);
+size_t disforge_index_seek(const struct disforge_index *idx, const uint8_t *code,
+                           size_t code_size, size_t offset);
+
+/*
+ * Columnar export
+ */
+
+int disforge_export_columns(const uint8_t *code, size_t code_size, size_t base, int fd);
+
+#ifdef DISFORGE_STATS
+// Add the calling thread's counters to the totals; call before a thread exits.
+void disforge_stats_merge(void);
+// Merge the calling thread's counters and print the report (an atexit() handler).
+void disforge_stats_report(void);
+#endif
+
+#endif
@@ -0,0 +1,1684 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "disforge.h"
+
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+// List everything readable from fd in STREAM_CHUNK_SIZE pieces.
+static int disassemble_fd_stream(struct disforge_sink *out, int fd, size_t base)
+{
+    static uint8_t chunk[STREAM_CHUNK_SIZE];
+    struct disforge_stream st;
+
+    disforge_stream_init(&st, base);
+    for (;;) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading input");
+            return EXIT_FAILURE;
+        }
+        if (n == 0)
+            break;
+        disforge_disassemble_stream(out, &st, chunk, (size_t) n);
+        if (out->error)
+            return EXIT_FAILURE;
+    }
+    disforge_disassemble_stream_end(out, &st);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * map_file() maps filename read-only into memory and hints the kernel that
+ * it will be read front to back. On success *size holds the file size and
+ * the mapping is returned (NULL with *size == 0 for an empty file); on
+ * failure an error is printed and MAP_FAILED is returned.
+ */
+static const uint8_t *map_file(const char *filename, size_t *size)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return MAP_FAILED;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error determining file size");
+        close(fd);
+        return MAP_FAILED;
+    }
+    *size = (size_t) st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error mapping file");
+        return MAP_FAILED;
+    }
+    madvise(map, *size, MADV_SEQUENTIAL);
+    return map;
+}
+
+/*
+ * Benchmarks
+ *
+ * --bench generates reproducible corpora (a fixed-seed xorshift generator)
+ * and times each stage of the pipeline over them: length-only decoding,
+ * decoding into records, decoding plus formatting into memory, and the
+ * full listing written to /dev/null.
+ */
+
+static uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// A ModR/M operand (with SIB and displacement as needed) for register reg.
+// mem_only forces a memory operand.
+static size_t bench_modrm(uint8_t *p, uint64_t *rng, uint8_t reg, int mem_only)
+{
+    uint64_t r = bench_rand(rng);
+    uint8_t mod, rm = r & 0x7;
+    size_t len = 1;
+
+    // Compiler output: mostly registers and small stack/frame offsets.
+    unsigned pick = (r >> 3) % 100;
+    if (!mem_only && pick < 40)
+        mod = 3;
+    else if (pick < 75)
+        mod = 1;
+    else if (pick < 85)
+        mod = 0;
+    else
+        mod = 2;
+    if (mem_only && (r >> 10) % 2)
+        rm = 4;
+    p[0] = (uint8_t)(mod << 6 | (reg & 0x7) << 3 | rm);
+    if (mod != 3 && rm == 4)
+        p[len++] = (uint8_t)(r >> 16);
+    if (mod == 1)
+        p[len++] = (uint8_t)(r >> 24);
+    else if (mod == 2 || (mod == 0 && rm == 5) ||
+             (mod == 0 && rm == 4 && (p[1] & 0x7) == 5)) {
+        memcpy(p + len, (const uint8_t *) &r + 4, 4);
+        len += 4;
+    }
+    return len;
+}
+
+// One instruction weighted roughly like 32-bit compiler output.
+static size_t bench_compiler_insn(uint8_t *p, uint64_t *rng)
+{
+    static const uint8_t alu[] = {0x03, 0x2B, 0x33, 0x3B, 0x0B, 0x23};
+    uint64_t r = bench_rand(rng);
+    unsigned pick = r % 100;
+    uint8_t reg = (r >> 8) & 0x7;
+    uint32_t imm = (uint32_t)(r >> 32);
+
+    if (pick < 20) {                       // MOV r, r/m / MOV r/m, r
+        p[0] = (r >> 11) & 1 ? 0x8B : 0x89;
+        return 1 + bench_modrm(p + 1, rng, reg, 0);
+    } else if (pick < 28) {                // ALU r, r/m
+        p[0] = alu[(r >> 11) % sizeof(alu)];
+        return 1 + bench_modrm(p + 1, rng, reg, 0);
+    } else if (pick < 36) {                // ADD/SUB/CMP r/m, imm8
+        static const uint8_t ops[] = {0, 5, 7};
+        p[0] = 0x83;
+        size_t n = 1 + bench_modrm(p + 1, rng, ops[(r >> 11) % 3], 0);
+        p[n] = (uint8_t) imm;
+        return n + 1;
+    } else if (pick < 44) {                // PUSH r
+        p[0] = 0x50 + reg;
+        return 1;
+    } else if (pick < 50) {                // POP r
+        p[0] = 0x58 + reg;
+        return 1;
+    } else if (pick < 56) {                // CALL rel32
+        p[0] = 0xE8;
+        memcpy(p + 1, &imm, 4);
+        return 5;
+    } else if (pick < 66) {                // Jcc rel8
+        p[0] = 0x70 + ((r >> 11) & 0xF);
+        p[1] = (uint8_t) imm;
+        return 2;
+    } else if (pick < 69) {                // JMP rel8
+        p[0] = 0xEB;
+        p[1] = (uint8_t) imm;
+        return 2;
+    } else if (pick < 75) {                // LEA r, m
+        p[0] = 0x8D;
+        return 1 + bench_modrm(p + 1, rng, reg, 1);
+    } else if (pick < 80) {                // TEST r/m, r
+        p[0] = 0x85;
+        return 1 + bench_modrm(p + 1, rng, reg, 0);
+    } else if (pick < 83) {                // RET
+        p[0] = 0xC3;
+        return 1;
+    } else if (pick < 88) {                // MOV r, imm32
+        p[0] = 0xB8 + reg;
+        memcpy(p + 1, &imm, 4);
+        return 5;
+    } else if (pick < 92) {                // MOVZX r, r/m8
+        p[0] = 0x0F;
+        p[1] = 0xB6;
+        return 2 + bench_modrm(p + 2, rng, reg, 0);
+    } else if (pick < 95) {                // MOV r/m, imm32
+        p[0] = 0xC7;
+        size_t n = 1 + bench_modrm(p + 1, rng, 0, 1);
+        memcpy(p + n, &imm, 4);
+        return n + 4;
+    } else if (pick < 97) {                // INC/DEC r
+        p[0] = ((r >> 11) & 1 ? 0x40 : 0x48) + reg;
+        return 1;
+    } else {                               // SHL/SHR/SAR r/m, imm8
+        static const uint8_t ops[] = {4, 5, 7};
+        p[0] = 0xC1;
+        size_t n = 1 + bench_modrm(p + 1, rng, ops[(r >> 11) % 3], 0);
+        p[n] = (uint8_t)(imm & 0x1F);
+        return n + 1;
+    }
+}
+
+// Memory-operand instructions only, half of them with a SIB byte.
+static size_t bench_modrm_insn(uint8_t *p, uint64_t *rng)
+{
+    static const uint8_t ops[] = {0x8B, 0x89, 0x8D, 0x03, 0x2B, 0x3B, 0x85, 0x33};
+    uint64_t r = bench_rand(rng);
+    p[0] = ops[r % sizeof(ops)];
+    return 1 + bench_modrm(p + 1, rng, (r >> 8) & 0x7, 1);
+}
+
+// LOCK/REP/REPNZ prefixes in front of string and read-modify-write instructions.
+static size_t bench_prefix_insn(uint8_t *p, uint64_t *rng)
+{
+    static const uint8_t prefixes[] = {0xF0, 0xF2, 0xF3};
+    static const uint8_t strings[] = {0xA4, 0xA5, 0xA6, 0xA7, 0xAA, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF};
+    uint64_t r = bench_rand(rng);
+    size_t n = 0;
+    for (unsigned k = 0; k < 1 + r % 3; k++)
+        p[n++] = prefixes[(r >> (4 + 2 * k)) % 3];
+    if ((r >> 12) & 1) {
+        p[n++] = strings[(r >> 13) % sizeof(strings)];
+        return n;
+    }
+    p[n++] = 0x01;
+    return n + bench_modrm(p + n, rng, (r >> 20) & 0x7, 1);
+}
+
+enum bench_corpus { BENCH_COMPILER, BENCH_MODRM, BENCH_PREFIX, BENCH_GARBAGE, BENCH_CORPORA };
+
+static const char *bench_corpus_names[BENCH_CORPORA] = {"compiler", "modrm", "prefix", "garbage"};
+
+static void bench_generate(uint8_t *buf, size_t size, enum bench_corpus corpus)
+{
+    uint64_t rng = 0x9E3779B97F4A7C15ull + corpus;
+    uint8_t insn[32];
+    size_t i = 0;
+
+    while (i < size) {
+        size_t n;
+        switch (corpus) {
+            case BENCH_COMPILER: n = bench_compiler_insn(insn, &rng); break;
+            case BENCH_MODRM:    n = bench_modrm_insn(insn, &rng); break;
+            case BENCH_PREFIX:   n = bench_prefix_insn(insn, &rng); break;
+            default: {
+                uint64_t r = bench_rand(&rng);
+                n = 8;
+                memcpy(insn, &r, 8);
+                break;
+            }
+        }
+        if (n > size - i)
+            n = size - i;
+        memcpy(buf + i, insn, n);
+        i += n;
+    }
+}
+
+static volatile size_t bench_checksum;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum bench_mode { BENCH_LENGTH, BENCH_DECODE, BENCH_BATCH, BENCH_FORMAT, BENCH_OUTPUT,
+                  BENCH_MODES };
+
+static const char *bench_mode_names[BENCH_MODES] = {
+    "length only", "decode", "decode batch", "decode+format", "full output"
+};
+
+#define BENCH_BATCH_LEN 4096
+
+// Run one mode over buf once. The returned checksum keeps the work observable.
+static size_t bench_once(enum bench_mode mode, const uint8_t *buf, size_t size,
+                         struct disforge_sink *text, int null_fd)
+{
+    struct disforge_insn insn;
+    size_t sum = 0, i = 0;
+
+    switch (mode) {
+        case BENCH_LENGTH: {
+            static size_t offsets[BENCH_BATCH_LEN];
+            while (i < size) {
+                size_t next;
+                disforge_find_offsets(buf + i, size - i, offsets, BENCH_BATCH_LEN, &next);
+                i += next;
+            }
+            sum = i;
+            break;
+        }
+        case BENCH_DECODE:
+            while (i < size) {
+                size_t len = disforge_decode_at(buf + i, size - i, i, &insn);
+                sum += insn.mnemonic + insn.imm;
+                if (len == 0)
+                    break;
+                i += len;
+            }
+            break;
+        case BENCH_BATCH: {
+            // The fields a typical analysis reads: mnemonic, length, target.
+            static uint8_t mnemonic[BENCH_BATCH_LEN], length[BENCH_BATCH_LEN];
+            static uint32_t target[BENCH_BATCH_LEN];
+            struct disforge_insn_array a = {
+                .mnemonic = mnemonic, .length = length, .target = target,
+            };
+            while (i < size) {
+                size_t used = disforge_decode_batch(buf + i, size - i, i, &a, BENCH_BATCH_LEN);
+                for (size_t n = 0; n < a.count; n++)
+                    sum += mnemonic[n] + target[n];
+                if (a.count == 0)
+                    break;   // only a truncated instruction is left
+                i += used;
+            }
+            break;
+        }
+        case BENCH_FORMAT:
+            while (i < size) {
+                size_t len = disforge_decode_at(buf + i, size - i, i, &insn);
+                disforge_print_insn(text, &insn);
+                if (text->len > text->cap / 2) {
+                    sum += text->len;
+                    text->len = 0;
+                }
+                if (len == 0)
+                    break;
+                i += len;
+            }
+            break;
+        case BENCH_OUTPUT: {
+            static char out_buf[1 << 20];
+            struct disforge_sink out;
+            disforge_sink_init(&out, null_fd, out_buf, sizeof(out_buf));
+            disforge_disassemble(&out, buf, size, 0);
+            sum = (size_t) disforge_sink_flush(&out);
+            break;
+        }
+        default:
+            break;
+    }
+    return sum;
+}
+
+/*
+ * run_benchmarks() times every mode on every corpus of corpus_size bytes
+ * (best of three runs) and writes a table to out.
+ */
+static int run_benchmarks(struct disforge_sink *out, size_t corpus_size)
+{
+    uint8_t *buf = malloc(corpus_size);
+    int null_fd = open("/dev/null", O_WRONLY);
+    struct disforge_sink text;
+
+    if (!buf || null_fd < 0 || disforge_sink_init_mem(&text, corpus_size / 4 + (1 << 16)) != 0) {
+        perror("Error setting up benchmark");
+        free(buf);
+        if (null_fd >= 0)
+            close(null_fd);
+        return EXIT_FAILURE;
+    }
+
+    char line[128];
+    snprintf(line, sizeof(line), "%-9s %-14s %10s %10s %10s %9s\n",
+             "corpus", "mode", "insns", "MB/s", "Minsn/s", "ns/insn");
+    disforge_sink_puts(out, line);
+    for (int corpus = 0; corpus < BENCH_CORPORA; corpus++) {
+        size_t count = 0, next = 0, offsets[4096];
+        bench_generate(buf, corpus_size, corpus);
+        while (next < corpus_size) {
+            size_t done = next;
+            count += disforge_find_offsets(buf + done, corpus_size - done, offsets, 4096, &next);
+            next += done;
+        }
+
+        // The modes take turns, so that a host slowing down for a while
+        // does not penalise whichever mode happens to run then.
+        double best[BENCH_MODES];
+        for (int run = 0; run < 3; run++) {
+            for (int mode = 0; mode < BENCH_MODES; mode++) {
+                text.len = 0;
+                double start = now_seconds();
+                bench_checksum += bench_once(mode, buf, corpus_size, &text, null_fd);
+                double elapsed = now_seconds() - start;
+                if (run == 0 || elapsed < best[mode])
+                    best[mode] = elapsed;
+            }
+        }
+        for (int mode = 0; mode < BENCH_MODES; mode++) {
+            snprintf(line, sizeof(line), "%-9s %-14s %10zu %10.1f %10.2f %9.2f\n",
+                     bench_corpus_names[corpus], bench_mode_names[mode], count,
+                     corpus_size / best[mode] / 1e6, count / best[mode] / 1e6,
+                     best[mode] * 1e9 / count);
+            disforge_sink_puts(out, line);
+        }
+        disforge_sink_flush(out);
+    }
+
+    disforge_sink_free_mem(&text);
+    close(null_fd);
+    free(buf);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Profiling
+ *
+ * --profile lists a file in batches of PROFILE_BATCH instructions: each
+ * batch is first decoded into records, then formatted into the output
+ * buffer, and the buffer is flushed between batches when it runs low. The
+ * monotonic clock is read at every phase change, so the run splits into
+ * load (mapping and faulting in the input), decode, format and write
+ * time. Where perf_event_open(2) is permitted, user-space cycles,
+ * instructions and branch misses are read at the same points.
+ */
+
+#define PROFILE_BATCH 1024
+#define PROFILE_LINE_MAX 128   // generous bound on one listing line
+
+enum profile_phase { PHASE_LOAD, PHASE_DECODE, PHASE_FORMAT, PHASE_WRITE, PHASE_COUNT };
+
+static const char *const phase_names[PHASE_COUNT] = {"load", "decode", "format", "write"};
+
+#define PROFILE_NCOUNTERS 3
+
+static const struct {
+    uint64_t    config;
+    const char *name;
+} profile_counters[PROFILE_NCOUNTERS] = {
+    {PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+};
+
+struct profile {
+    double   seconds[PHASE_COUNT];
+    uint64_t counts[PHASE_COUNT][PROFILE_NCOUNTERS];
+    double   mark;                        // time of the last phase change
+    uint64_t mark_counts[PROFILE_NCOUNTERS];
+    int      perf_fd;                     // counter group leader, -1 without counters
+    int      perf_fds[PROFILE_NCOUNTERS]; // the group, leader first
+    size_t   bytes;
+    size_t   insns;
+};
+
+// Read the counter group into values; returns 0 on success.
+static int profile_read(const struct profile *p, uint64_t *values)
+{
+    uint64_t buf[1 + PROFILE_NCOUNTERS];
+
+    if (p->perf_fd < 0 || read(p->perf_fd, buf, sizeof(buf)) != (ssize_t) sizeof(buf))
+        return -1;
+    memcpy(values, buf + 1, PROFILE_NCOUNTERS * sizeof(uint64_t));
+    return 0;
+}
+
+// Close the counter group; every member has its own descriptor.
+static void profile_close(struct profile *p, int nfds)
+{
+    for (int n = 0; n < nfds; n++)
+        close(p->perf_fds[n]);
+    p->perf_fd = -1;
+}
+
+static void profile_init(struct profile *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->perf_fd = -1;
+    for (int n = 0; n < PROFILE_NCOUNTERS; n++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = profile_counters[n].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, p->perf_fd, 0);
+        if (fd < 0) {
+            // All or nothing: a partial group would mislabel the columns.
+            profile_close(p, n);
+            break;
+        }
+        p->perf_fds[n] = fd;
+        if (p->perf_fd < 0)
+            p->perf_fd = fd;
+    }
+    p->mark = now_seconds();
+    profile_read(p, p->mark_counts);
+}
+
+// Charge the time (and counts) since the last phase change to phase.
+static void profile_add(struct profile *p, enum profile_phase phase)
+{
+    uint64_t now_counts[PROFILE_NCOUNTERS];
+    double now = now_seconds();
+
+    p->seconds[phase] += now - p->mark;
+    p->mark = now;
+    if (profile_read(p, now_counts) == 0) {
+        for (int n = 0; n < PROFILE_NCOUNTERS; n++)
+            p->counts[phase][n] += now_counts[n] - p->mark_counts[n];
+        memcpy(p->mark_counts, now_counts, sizeof(now_counts));
+    }
+}
+
+// Start a new phase without charging the time since the last change.
+static void profile_skip(struct profile *p)
+{
+    p->mark = now_seconds();
+    profile_read(p, p->mark_counts);
+}
+
+/*
+ * disassemble_profiled() writes the same listing as disforge_disassemble(),
+ * timing the decode, format and write phases separately.
+ */
+static void disassemble_profiled(struct disforge_sink *out, const uint8_t *code, size_t code_size,
+                                 size_t base, struct profile *p)
+{
+    static struct disforge_insn batch[PROFILE_BATCH];
+    static size_t at[PROFILE_BATCH];
+    size_t i = 0;
+
+    p->bytes += code_size;
+    profile_skip(p);
+    while (i < code_size) {
+        size_t n = 0;
+        while (n < PROFILE_BATCH && i < code_size) {
+            size_t len = disforge_decode_at(code + i, code_size - i, base + i, &batch[n]);
+            at[n++] = i;
+            if (len == 0) {
+                i = code_size;
+                break;
+            }
+            i += len;
+        }
+        profile_add(p, PHASE_DECODE);
+
+        if (out->cap - out->len < PROFILE_BATCH * PROFILE_LINE_MAX) {
+            disforge_sink_flush(out);
+            profile_add(p, PHASE_WRITE);
+        }
+        for (size_t k = 0; k < n; k++)
+            disforge_list_insn(out, &batch[k], base + at[k]);
+        profile_add(p, PHASE_FORMAT);
+        p->insns += n;
+    }
+}
+
+static void profile_report(struct profile *p)
+{
+    double total = 0;
+
+    for (int ph = 0; ph < PHASE_COUNT; ph++)
+        total += p->seconds[ph];
+    fprintf(stderr, "\nProfile: %zu bytes, %zu instructions, %.3f s",
+            p->bytes, p->insns, total);
+    if (total > 0)
+        fprintf(stderr, " (%.1f MB/s)", p->bytes / total / 1e6);
+    fprintf(stderr, "\n  %-8s %10s %7s", "phase", "seconds", "share");
+    if (p->perf_fd >= 0)
+        for (int n = 0; n < PROFILE_NCOUNTERS; n++)
+            fprintf(stderr, " %14s", profile_counters[n].name);
+    fputc('\n', stderr);
+    for (int ph = 0; ph < PHASE_COUNT; ph++) {
+        fprintf(stderr, "  %-8s %10.4f %6.1f%%", phase_names[ph], p->seconds[ph],
+                total > 0 ? 100 * p->seconds[ph] / total : 0.0);
+        if (p->perf_fd >= 0)
+            for (int n = 0; n < PROFILE_NCOUNTERS; n++)
+                fprintf(stderr, " %14" PRIu64, p->counts[ph][n]);
+        fputc('\n', stderr);
+    }
+    if (p->perf_fd < 0)
+        fprintf(stderr, "  (hardware counters unavailable: perf_event_open failed)\n");
+    else
+        profile_close(p, PROFILE_NCOUNTERS);
+}
+
+// Command-line settings
+struct cli_options {
+    int threads;    // worker threads for file mode, 1 = serial
+    int pipeline;   // formatter threads of a pipelined listing, 0 = not pipelined
+    int raw;        // treat ELF files as raw bytes too
+    int boundaries; // write the instruction-start bitmap instead of a listing
+    long bench_mb;  // run the benchmarks on corpora of this many MB
+    int recursive;  // recursive descent instead of a linear sweep
+    int cfg;        // list basic blocks and their successors
+    int format;     // enum disforge_format of listings
+    struct profile *profile;  // time the listing phases (--profile)
+    size_t base;    // load address of raw input
+    const char *build_index;  // write a boundary index of the file here
+    const char *index;        // boundary index of the file, for --start
+    const char *columns;      // write a columnar export of the file here
+    int range;      // --start, --end or --count given
+    size_t start;   // first address to list
+    size_t end;     // list instructions starting before this address
+    size_t count;   // list at most this many instructions
+    uint32_t index_interval;  // instructions between index checkpoints
+    size_t *entries;  // --entry addresses for recursive descent
+    size_t nentries;
+    uint8_t *entry_listed;  // per --entry, set once it lies in listed code (NULL: unchecked)
+};
+
+/*
+ * list_code() lists code loaded at addr, by linear sweep or, with
+ * --recursive or --cfg, by recursive descent from the --entry addresses
+ * inside it. Without --entry, descent starts at entry (when inside the
+ * code) and at the first byte.
+ */
+static int list_code(struct disforge_sink *out, const uint8_t *code, size_t len, size_t addr,
+                     size_t entry, const struct cli_options *opts)
+{
+    if (!opts->recursive) {
+        if (opts->profile)
+            disassemble_profiled(out, code, len, addr, opts->profile);
+        else if (opts->pipeline)
+            disforge_disassemble_pipelined(out, code, len, addr, opts->pipeline);
+        else
+            disforge_disassemble_parallel(out, code, len, addr, opts->threads);
+        return EXIT_SUCCESS;
+    }
+
+    size_t *entries = malloc((opts->nentries + 2) * sizeof(*entries));
+    size_t n = 0;
+    if (!entries) {
+        perror("Error allocating entry points");
+        return EXIT_FAILURE;
+    }
+    for (size_t k = 0; k < opts->nentries; k++) {
+        if (opts->entries[k] - addr < len) {
+            entries[n++] = opts->entries[k] - addr;
+            if (opts->entry_listed)
+                opts->entry_listed[k] = 1;
+        }
+    }
+    if (opts->nentries == 0) {
+        if (entry - addr < len)
+            entries[n++] = entry - addr;
+        entries[n++] = 0;
+    }
+    int status = EXIT_SUCCESS;
+    int rc = opts->cfg ? disforge_disassemble_cfg(out, code, len, addr, entries, n)
+                       : disforge_disassemble_recursive(out, code, len, addr, entries, n);
+    if (rc != 0) {
+        perror("Error allocating recursive descent state");
+        status = EXIT_FAILURE;
+    }
+    free(entries);
+    return status;
+}
+
+/*
+ * ELF32 input
+ *
+ * Executable sections (or, without section headers, executable PT_LOAD
+ * segments) are disassembled in place from the file mapping, with the
+ * address column showing their virtual addresses.
+ */
+
+static int is_elf32(const uint8_t *code, size_t size)
+{
+    return size >= sizeof(Elf32_Ehdr) && memcmp(code, ELFMAG, SELFMAG) == 0 &&
+           code[EI_CLASS] == ELFCLASS32;
+}
+
+// Does [offset, offset + len) lie inside a file of the given size?
+static int in_file(uint64_t offset, uint64_t len, size_t size)
+{
+    return offset <= size && len <= size - offset;
+}
+
+static int elf_list(struct disforge_sink *out, const uint8_t *code, const char *kind,
+                    const char *name, uint32_t offset, uint32_t len, uint32_t addr,
+                    uint32_t entry, const struct cli_options *opts)
+{
+    if (out->format == DISFORGE_RECORDS)
+        return list_code(out, code + offset, len, addr, entry, opts);
+    disforge_sink_puts(out, "\nDisassembly of ");
+    disforge_sink_puts(out, kind);
+    disforge_sink_putc(out, ' ');
+    disforge_sink_puts(out, name);
+    disforge_sink_write(out, " (0x", 4);
+    disforge_sink_hex(out, addr, 8);
+    disforge_sink_write(out, "):\n", 3);
+    return list_code(out, code + offset, len, addr, entry, opts);
+}
+
+/*
+ * disassemble_elf() lists the executable parts of a little-endian i386
+ * ELF32 image. Returns EXIT_SUCCESS, or EXIT_FAILURE for a malformed or
+ * unsupported file.
+ */
+static int disassemble_elf(struct disforge_sink *out, const uint8_t *code, size_t size,
+                           const struct cli_options *opts)
+{
+    Elf32_Ehdr eh;
+    int listed = 0;
+
+    memcpy(&eh, code, sizeof(eh));
+    if (eh.e_ident[EI_DATA] != ELFDATA2LSB || eh.e_machine != EM_386) {
+        fprintf(stderr, "Unsupported ELF file (only little-endian i386 is supported)\n");
+        return EXIT_FAILURE;
+    }
+
+    if (eh.e_shnum > 0 && eh.e_shentsize == sizeof(Elf32_Shdr) &&
+        in_file(eh.e_shoff, (uint64_t) eh.e_shnum * sizeof(Elf32_Shdr), size)) {
+        const uint8_t *shdrs = code + eh.e_shoff;
+        Elf32_Shdr strtab = {0};
+        if (eh.e_shstrndx < eh.e_shnum)
+            memcpy(&strtab, shdrs + eh.e_shstrndx * sizeof(Elf32_Shdr), sizeof(strtab));
+        if (!in_file(strtab.sh_offset, strtab.sh_size, size))
+            strtab.sh_size = 0;
+
+        for (unsigned n = 0; n < eh.e_shnum; n++) {
+            Elf32_Shdr sh;
+            memcpy(&sh, shdrs + n * sizeof(Elf32_Shdr), sizeof(sh));
+            if (sh.sh_type != SHT_PROGBITS || !(sh.sh_flags & SHF_EXECINSTR) || sh.sh_size == 0)
+                continue;
+            if (!in_file(sh.sh_offset, sh.sh_size, size)) {
+                fprintf(stderr, "Section %u lies outside the file, skipped\n", n);
+                continue;
+            }
+            const char *name = "?";
+            if (sh.sh_name < strtab.sh_size &&
+                memchr(code + strtab.sh_offset + sh.sh_name, '\0', strtab.sh_size - sh.sh_name))
+                name = (const char *)(code + strtab.sh_offset + sh.sh_name);
+            if (elf_list(out, code, "section", name, sh.sh_offset, sh.sh_size, sh.sh_addr,
+                         eh.e_entry, opts) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            listed++;
+        }
+        if (listed > 0)
+            return EXIT_SUCCESS;
+    }
+
+    // No usable section headers: fall back to the program headers.
+    if (eh.e_phnum > 0 && eh.e_phentsize == sizeof(Elf32_Phdr) &&
+        in_file(eh.e_phoff, (uint64_t) eh.e_phnum * sizeof(Elf32_Phdr), size)) {
+        for (unsigned n = 0; n < eh.e_phnum; n++) {
+            Elf32_Phdr ph;
+            char name[16];
+            memcpy(&ph, code + eh.e_phoff + n * sizeof(Elf32_Phdr), sizeof(ph));
+            if (ph.p_type != PT_LOAD || !(ph.p_flags & PF_X) || ph.p_filesz == 0)
+                continue;
+            if (!in_file(ph.p_offset, ph.p_filesz, size)) {
+                fprintf(stderr, "Segment %u lies outside the file, skipped\n", n);
+                continue;
+            }
+            snprintf(name, sizeof(name), "%u", n);
+            if (elf_list(out, code, "segment", name, ph.p_offset, ph.p_filesz, ph.p_vaddr,
+                         eh.e_entry, opts) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            listed++;
+        }
+    }
+    if (listed == 0) {
+        fprintf(stderr, "No executable sections or segments found\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * write_boundaries() writes the instruction-start bitmap of a linear sweep
+ * over code as (code_size + 7) / 8 raw bytes: bit j of byte k is set when
+ * an instruction starts at offset 8 * k + j.
+ */
+static int write_boundaries(struct disforge_sink *out, const uint8_t *code, size_t code_size)
+{
+    uint64_t *bitmap = malloc((code_size + 63) / 64 * sizeof(uint64_t));
+    if (!bitmap) {
+        perror("Error allocating boundary bitmap");
+        return EXIT_FAILURE;
+    }
+    disforge_find_boundaries(code, code_size, bitmap);
+    for (size_t w = 0; w < (code_size + 63) / 64; w++) {
+        uint8_t bytes[8];
+        for (int k = 0; k < 8; k++)
+            bytes[k] = (uint8_t)(bitmap[w] >> (8 * k));
+        size_t n = (code_size + 7) / 8 - w * 8;
+        disforge_sink_write(out, (const char *) bytes, n < 8 ? n : 8);
+    }
+    free(bitmap);
+    return EXIT_SUCCESS;
+}
+
+// The index fingerprint of a file: its modification time in nanoseconds.
+static uint64_t file_fingerprint(const struct stat *st)
+{
+    return (uint64_t) st->st_mtim.tv_sec * 1000000000u + (uint64_t) st->st_mtim.tv_nsec;
+}
+
+// Build the boundary index of the whole file and write it to opts->build_index.
+static int write_index(const uint8_t *code, size_t size, const char *filename,
+                       const struct cli_options *opts)
+{
+    struct disforge_index idx;
+    struct stat st;
+
+    if (stat(filename, &st) != 0) {
+        perror("Error determining file modification time");
+        return EXIT_FAILURE;
+    }
+    if (disforge_index_build(code, size, opts->index_interval, &idx) != 0) {
+        perror("Error building index");
+        return EXIT_FAILURE;
+    }
+    idx.hdr.fingerprint = file_fingerprint(&st);
+    int fd = open(opts->build_index, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int err = fd < 0 ? errno : disforge_index_write(&idx, fd);
+    if (fd >= 0 && close(fd) != 0 && !err)
+        err = errno;
+    disforge_index_free(&idx);
+    if (err) {
+        fprintf(stderr, "Error writing index %s: %s\n", opts->build_index, strerror(err));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// disforge_index_load(), with a failure reported on stderr.
+static int load_index(struct disforge_index *idx, const char *path, const struct stat *st)
+{
+    size_t size = (size_t) st->st_size;
+    int err = disforge_index_load(idx, path, size, file_fingerprint(st));
+    if (err == DISFORGE_INDEX_STALE && idx->hdr.code_size != size)
+        fprintf(stderr, "Index %s was built for a %" PRIu64 "-byte input, not %zu bytes\n",
+                path, idx->hdr.code_size, size);
+    else if (err == DISFORGE_INDEX_STALE)
+        fprintf(stderr, "Index %s was built for another version of the input; "
+                "rebuild it with --build-index\n", path);
+    else if (err == DISFORGE_INDEX_INVALID)
+        fprintf(stderr, "Not a valid disforge index: %s\n", path);
+    else if (err)
+        fprintf(stderr, "Error opening index %s: %s\n", path, strerror(err));
+    return err;
+}
+
+/*
+ * disassemble_file_range() lists the instructions of a raw file selected
+ * by --start, --end and --count, mapping only the pages they occupy. With
+ * --index, listing starts at the instruction of the linear sweep covering
+ * --start, found from the nearest checkpoint; without it --start must be
+ * an instruction boundary.
+ */
+static int disassemble_file_range(struct disforge_sink *out, const char *filename,
+                                  const struct cli_options *opts)
+{
+    struct disforge_index idx = {0};
+    struct stat st;
+    int status = EXIT_FAILURE;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return EXIT_FAILURE;
+    }
+    if (fstat(fd, &st) != 0) {
+        perror("Error determining file size");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    size_t size = (size_t) st.st_size;
+    if (opts->start < opts->base || opts->start - opts->base >= size) {
+        fprintf(stderr, "--start 0x%zx lies outside the file (0x%zx to 0x%zx)\n",
+                opts->start, opts->base, opts->base + size);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    size_t from = opts->start - opts->base;
+    size_t to = opts->end - opts->base < size ? opts->end - opts->base : size;
+
+    if (opts->index && load_index(&idx, opts->index, &st) != 0) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    disforge_list_header(out, "Disassembled code from file", filename);
+
+    // Map from the checkpoint (or from) to where the last instruction can end.
+    size_t checkpoint = opts->index ? disforge_index_checkpoint(&idx, from) : from;
+    size_t limit = to;
+    if (opts->count < (to - from) / DISFORGE_MAX_INSN_LEN)
+        limit = from + opts->count * DISFORGE_MAX_INSN_LEN;
+    limit = size - limit > DISFORGE_MAX_INSN_LEN ? limit + DISFORGE_MAX_INSN_LEN : size;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t map_from = checkpoint / page * page;
+    size_t map_len = limit - map_from;
+    void *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, (off_t) map_from);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error mapping file");
+        goto done;
+    }
+
+    const uint8_t *code = map;
+    size_t i = checkpoint - map_from;
+    if (opts->index)
+        i = disforge_insn_covering(code, map_len, i, from - map_from);
+    for (size_t n = 0; n < opts->count && i < to - map_from; n++) {
+        size_t len = disforge_disassemble_line(out, code, map_len, opts->base + map_from, i);
+        if (len == 0)
+            break;
+        i += len;
+    }
+    munmap(map, map_len);
+    status = EXIT_SUCCESS;
+
+done:
+    if (opts->index)
+        disforge_index_free(&idx);
+    return status;
+}
+
+// Write the columnar export of the whole file to opts->columns.
+static int write_columns(const uint8_t *code, size_t size, const struct cli_options *opts)
+{
+    int fd = open(opts->columns, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int err = fd < 0 ? errno : disforge_export_columns(code, size, opts->base, fd);
+    if (fd >= 0 && close(fd) != 0 && !err)
+        err = errno;
+    if (err) {
+        fprintf(stderr, "Error writing columns %s: %s\n", opts->columns, strerror(err));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Disassemble a file straight out of its read-only mapping.
+static int disassemble_file(struct disforge_sink *out, const char *filename,
+                            const struct cli_options *opts)
+{
+    size_t size;
+    int status = EXIT_SUCCESS;
+    if (opts->range && !opts->boundaries && !opts->build_index && !opts->columns)
+        return disassemble_file_range(out, filename, opts);
+
+    if (opts->profile)
+        profile_skip(opts->profile);
+    const uint8_t *code = map_file(filename, &size);
+    if (code == MAP_FAILED)
+        return EXIT_FAILURE;
+    if (opts->profile && code) {
+        // Fault the whole input in now so that reading it counts as loading.
+        volatile uint8_t sink = 0;
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        madvise((void *) code, size, MADV_WILLNEED);
+        for (size_t i = 0; i < size; i += page)
+            sink += code[i];
+        (void) sink;
+        profile_add(opts->profile, PHASE_LOAD);
+    }
+
+    if (opts->boundaries || opts->build_index || opts->columns) {
+        if (opts->boundaries)
+            status = write_boundaries(out, code, size);
+        else if (opts->build_index)
+            status = write_index(code, size, filename, opts);
+        else
+            status = write_columns(code, size, opts);
+        if (code)
+            munmap((void *) code, size);
+        return status;
+    }
+
+    // Raw input is one range, so an --entry outside it is known before listing.
+    int elf = !opts->raw && is_elf32(code, size);
+    for (size_t k = 0; k < opts->nentries && opts->entry_listed && !elf; k++) {
+        if (opts->entries[k] - opts->base >= size) {
+            fprintf(stderr, "--entry 0x%zx lies outside the file (0x%zx to 0x%zx)\n",
+                    opts->entries[k], opts->base, opts->base + size);
+            if (code)
+                munmap((void *) code, size);
+            return EXIT_FAILURE;
+        }
+    }
+
+    disforge_list_header(out, "Disassembled code from file", filename);
+    if (elf)
+        status = disassemble_elf(out, code, size, opts);
+    else
+        status = list_code(out, code, size, opts->base, opts->base, opts);
+    for (size_t k = 0; k < opts->nentries && opts->entry_listed; k++) {
+        if (!opts->entry_listed[k]) {
+            fprintf(stderr, "--entry 0x%zx lies outside the listed code\n", opts->entries[k]);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    if (opts->profile) {
+        profile_skip(opts->profile);
+        disforge_sink_flush(out);
+        profile_add(opts->profile, PHASE_WRITE);
+        profile_report(opts->profile);
+    }
+    if (code)
+        munmap((void *) code, size);
+    return status;
+}
+
+// Flush the sink and turn a write failure into an exit status.
+static int flush_output(struct disforge_sink *out, int status)
+{
+    int error = disforge_sink_flush(out);
+
+    if (error != 0) {
+        fprintf(stderr, "Error writing output: %s\n", strerror(error));
+        return EXIT_FAILURE;
+    }
+    return status;
+}
+
+// flush_output(), then release the sink's ring if it has one.
+static int finish_output(struct disforge_sink *out, int status)
+{
+    status = flush_output(out, status);
+    disforge_sink_free_async(out);
+    return status;
+}
+
+// Say once that --io-uring could not set up a ring and writes with writev(2).
+static void report_no_uring(const struct disforge_sink *out)
+{
+    static int reported;
+
+    if (!disforge_sink_async_active(out) && !__atomic_exchange_n(&reported, 1, __ATOMIC_RELAXED))
+        fprintf(stderr, "io_uring is not available; writing with writev(2) instead\n");
+}
+
+/*
+ * Batch mode
+ *
+ * --batch lists many files in one process, each into its own file in the
+ * output directory. The inputs are split into one contiguous range per
+ * worker thread. A worker takes files from the front of its own range;
+ * once that is empty it steals the back half of another worker's range, so
+ * a few large files cannot leave the other workers idle. Each range has
+ * its own lock, held only to move its bounds, and each worker lists into
+ * its own output buffer. Outputs are named after the input's file name, so
+ * two inputs with the same file name are rejected before any is listed.
+ */
+
+#define BATCH_BUF_SIZE (1 << 20)
+
+struct batch_queue {
+    pthread_mutex_t lock;
+    size_t head, tail;      // files [head, tail) not taken yet
+};
+
+struct batch_state {
+    char **paths;
+    size_t npaths;
+    const char *out_dir;
+    int io_uring;             // write the outputs through io_uring (--io-uring)
+    struct cli_options opts;  // the options each file is listed with
+    struct batch_queue *queues;
+    int nworkers;
+};
+
+struct batch_worker {
+    struct batch_state *st;
+    int id;
+    size_t failed;          // files that could not be listed
+};
+
+// Take the next file from the worker's own range. Returns 0 if it is empty.
+static int batch_take(struct batch_queue *q, size_t *file)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        *file = q->head++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+// Move the back half of another worker's range to worker id and take its first file.
+static int batch_steal(struct batch_state *st, int id, size_t *file)
+{
+    for (int k = 1; k < st->nworkers; k++) {
+        struct batch_queue *victim = &st->queues[(id + k) % st->nworkers];
+        size_t from = 0, to = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            to = victim->tail;
+            from = to - (to - victim->head + 1) / 2;
+            victim->tail = from;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (from == to)
+            continue;
+
+        struct batch_queue *own = &st->queues[id];
+        pthread_mutex_lock(&own->lock);
+        own->head = from + 1;
+        own->tail = to;
+        pthread_mutex_unlock(&own->lock);
+        *file = from;
+        return 1;
+    }
+    return 0;
+}
+
+// The file name part of path, which names its output.
+static const char *batch_name(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    return name ? name + 1 : path;
+}
+
+static int batch_name_cmp(const void *a, const void *b)
+{
+    return strcmp(batch_name(*(char *const *) a), batch_name(*(char *const *) b));
+}
+
+/*
+ * batch_check_names() reports inputs that share a file name, whose
+ * outputs would overwrite each other. Returns 0, or -1 if there are any
+ * (or if out of memory).
+ */
+static int batch_check_names(const struct batch_state *st)
+{
+    char **sorted = malloc(st->npaths * sizeof(*sorted) + 1);
+    int err = 0;
+
+    if (!sorted) {
+        perror("Error checking batch inputs");
+        return -1;
+    }
+    memcpy(sorted, st->paths, st->npaths * sizeof(*sorted));
+    qsort(sorted, st->npaths, sizeof(*sorted), batch_name_cmp);
+    for (size_t n = 1; n < st->npaths; n++) {
+        if (batch_name_cmp(&sorted[n - 1], &sorted[n]) == 0) {
+            fprintf(stderr, "%s and %s would both be listed to %s/%s\n",
+                    sorted[n - 1], sorted[n], st->out_dir, batch_name(sorted[n]));
+            err = -1;
+        }
+    }
+    free(sorted);
+    return err;
+}
+
+/*
+ * batch_file() lists one input into out_dir through the worker's sink out,
+ * which is set up over buf for its first file and reopened for the next
+ * ones, so a worker keeps one io_uring ring for all its files. Returns
+ * EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int batch_file(const struct batch_state *st, const char *path, struct disforge_sink *out,
+                      char *buf)
+{
+    const char *name = batch_name(path);
+    const char *ext = st->opts.boundaries ? ".bits" :
+                      st->opts.format == DISFORGE_RECORDS ? ".rec" : ".lst";
+    char out_path[4096];
+
+    if ((size_t) snprintf(out_path, sizeof(out_path), "%s/%s%s", st->out_dir, name, ext) >=
+        sizeof(out_path)) {
+        fprintf(stderr, "Output path too long for %s\n", path);
+        return EXIT_FAILURE;
+    }
+    int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating %s: %s\n", out_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (out->buf) {
+        disforge_sink_reopen(out, fd);
+    } else if (st->io_uring) {
+        disforge_sink_init_async(out, fd, buf, BATCH_BUF_SIZE);
+        report_no_uring(out);
+    } else {
+        disforge_sink_init(out, fd, buf, BATCH_BUF_SIZE);
+    }
+    out->format = st->opts.format;
+    int status = flush_output(out, disassemble_file(out, path, &st->opts));
+    if (close(fd) != 0 && status == EXIT_SUCCESS) {
+        fprintf(stderr, "Error writing %s: %s\n", out_path, strerror(errno));
+        status = EXIT_FAILURE;
+    }
+    if (status != EXIT_SUCCESS)
+        unlink(out_path);
+    return status;
+}
+
+static void *batch_worker(void *arg)
+{
+    struct batch_worker *w = arg;
+    struct batch_state *st = w->st;
+    char *buf = malloc(BATCH_BUF_SIZE);
+    struct disforge_sink out = { .buf = NULL, .async = NULL };
+    size_t file;
+
+    while (batch_take(&st->queues[w->id], &file) || batch_steal(st, w->id, &file)) {
+        if (!buf || batch_file(st, st->paths[file], &out, buf) != EXIT_SUCCESS) {
+            fprintf(stderr, "Error listing %s\n", st->paths[file]);
+            w->failed++;
+        }
+    }
+    disforge_sink_free_async(&out);
+    free(buf);
+#ifdef DISFORGE_STATS
+    disforge_stats_merge();
+#endif
+    return NULL;
+}
+
+// Append a copy of path to the batch. Returns 0, or -1 if out of memory.
+static int batch_add(struct batch_state *st, size_t *cap, const char *dir, const char *name)
+{
+    if (st->npaths == *cap) {
+        size_t grown_cap = *cap ? 2 * *cap : 1024;
+        char **grown = realloc(st->paths, grown_cap * sizeof(*grown));
+        if (!grown)
+            return -1;
+        st->paths = grown;
+        *cap = grown_cap;
+    }
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (!path)
+        return -1;
+    if (*dir)
+        sprintf(path, "%s/%s", dir, name);
+    else
+        strcpy(path, name);
+    st->paths[st->npaths++] = path;
+    return 0;
+}
+
+/*
+ * batch_collect() reads the inputs of --batch=source: every file in it
+ * (not descending into subdirectories, and skipping hidden ones) if it is
+ * a directory, otherwise one path per line of the list file ("-" for
+ * standard input). Returns 0, or -1 after printing an error.
+ */
+static int batch_collect(struct batch_state *st, const char *source)
+{
+    struct stat sb;
+    size_t cap = 0;
+
+    if (strcmp(source, "-") != 0 && stat(source, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+        DIR *dir = opendir(source);
+        struct dirent *de;
+        if (!dir) {
+            perror("Error opening batch directory");
+            return -1;
+        }
+        while ((de = readdir(dir)) != NULL) {
+            if (de->d_name[0] == '.' || de->d_type == DT_DIR)
+                continue;
+            if (batch_add(st, &cap, source, de->d_name) != 0) {
+                closedir(dir);
+                perror("Error reading batch directory");
+                return -1;
+            }
+            if (de->d_type == DT_UNKNOWN && stat(st->paths[st->npaths - 1], &sb) == 0 &&
+                S_ISDIR(sb.st_mode))
+                free(st->paths[--st->npaths]);
+        }
+        closedir(dir);
+        return 0;
+    }
+
+    FILE *list = strcmp(source, "-") == 0 ? stdin : fopen(source, "r");
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    int err = 0;
+    if (!list) {
+        perror("Error opening batch list");
+        return -1;
+    }
+    while (!err && (n = getline(&line, &line_cap, list)) > 0) {
+        if (line[n - 1] == '\n')
+            line[--n] = '\0';
+        if (n > 0 && batch_add(st, &cap, "", line) != 0)
+            err = 1;
+    }
+    if (err || ferror(list)) {
+        perror("Error reading batch list");
+        err = 1;
+    }
+    free(line);
+    if (list != stdin)
+        fclose(list);
+    return err ? -1 : 0;
+}
+
+/*
+ * run_batch() lists every input of --batch=source into out_dir with
+ * nworkers threads, through io_uring if asked. Returns EXIT_FAILURE if any
+ * input failed.
+ */
+static int run_batch(const char *source, const char *out_dir, int nworkers, int io_uring,
+                     const struct cli_options *opts)
+{
+    struct batch_state st = { .out_dir = out_dir, .io_uring = io_uring, .opts = *opts };
+    int status = EXIT_FAILURE;
+
+    st.opts.threads = 1;
+    st.opts.pipeline = 0;
+    st.opts.entry_listed = NULL;   // an --entry need not lie in every input
+    if (batch_collect(&st, source) != 0 || batch_check_names(&st) != 0)
+        goto done;
+    if ((size_t) nworkers > st.npaths)
+        nworkers = st.npaths > 0 ? (int) st.npaths : 1;
+    st.nworkers = nworkers;
+
+    st.queues = calloc(nworkers, sizeof(*st.queues));
+    struct batch_worker *workers = calloc(nworkers, sizeof(*workers));
+    pthread_t *threads = calloc(nworkers, sizeof(*threads));
+    if (!st.queues || !workers || !threads) {
+        perror("Error allocating batch workers");
+        free(threads);
+        free(workers);
+        goto done;
+    }
+    for (int w = 0; w < nworkers; w++) {
+        pthread_mutex_init(&st.queues[w].lock, NULL);
+        st.queues[w].head = st.npaths * w / nworkers;
+        st.queues[w].tail = st.npaths * (w + 1) / nworkers;
+        workers[w].st = &st;
+        workers[w].id = w;
+    }
+
+    // Workers that cannot be started leave their range to be stolen; the
+    // calling thread is worker 0.
+    int started = 1;
+    while (started < nworkers &&
+           pthread_create(&threads[started], NULL, batch_worker, &workers[started]) == 0)
+        started++;
+    batch_worker(&workers[0]);
+    size_t failed = workers[0].failed;
+    for (int w = 1; w < started; w++) {
+        pthread_join(threads[w], NULL);
+        failed += workers[w].failed;
+    }
+    for (int w = 0; w < nworkers; w++)
+        pthread_mutex_destroy(&st.queues[w].lock);
+    free(threads);
+    free(workers);
+    status = failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+done:
+    for (size_t n = 0; n < st.npaths; n++)
+        free(st.paths[n]);
+    free(st.paths);
+    free(st.queues);
+    return status;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [machine_code_file | -]\n"
+            "  -                 stream raw machine code from standard input\n"
+            "  -j, --threads=N   disassemble the file with N threads (0 = one per CPU)\n"
+            "      --batch=SRC   list every file in directory SRC, or named (one per\n"
+            "                    line) in the list file SRC, with -j workers (default\n"
+            "                    one per CPU); needs --out-dir\n"
+            "      --out-dir=DIR where --batch writes NAME.lst (NAME.rec with\n"
+            "                    --format=bin, NAME.bits with --boundaries) per input\n"
+            "      --pipeline[=N]\n"
+            "                    decode, format (on N threads, default CPUs - 2) and\n"
+            "                    write the listing on separate threads\n"
+            "      --io-uring    write standard output (or the --batch outputs) in the\n"
+            "                    background through io_uring, double-buffered\n"
+            "                    (writev(2) if unavailable)\n"
+            "      --raw         treat ELF files as raw bytes\n"
+            "      --base=ADDR   load address of raw input (default 0)\n"
+            "      --recursive   follow control flow from the entry points instead of a\n"
+            "                    linear sweep; bytes not reached are listed as data\n"
+            "      --cfg         list the basic blocks of the code reached by --recursive,\n"
+            "                    each with its successor blocks\n"
+            "      --entry=ADDR  entry point for --recursive (repeatable; default: the\n"
+            "                    ELF entry point and the start of each listed range)\n"
+            "      --boundaries  write a bitmap of instruction starts (one bit per input\n"
+            "                    byte, raw bytes, whole file) instead of a listing\n"
+            "      --build-index=FILE\n"
+            "                    write an instruction-boundary index of the file (raw\n"
+            "                    bytes, whole file) to FILE instead of a listing\n"
+            "      --index-interval=K\n"
+            "                    instructions between index checkpoints (default 256)\n"
+            "      --format=FMT  listing format: text (default) or bin, a header followed\n"
+            "                    by one 32-byte record per instruction\n"
+            "      --columns=FILE\n"
+            "                    write the decoded instructions (raw bytes, whole file)\n"
+            "                    to FILE as one array per field instead of a listing\n"
+            "      --start=ADDR  list from the instruction at ADDR (raw input)\n"
+            "      --end=ADDR    list only instructions starting before ADDR (raw input)\n"
+            "      --count=N     list at most N instructions (raw input)\n"
+            "      --index=FILE  index from --build-index; --start then seeks to the\n"
+            "                    instruction covering ADDR from the nearest checkpoint\n"
+            "      --profile     time loading, decoding, formatting and writing (serial\n"
+            "                    linear listing) and print a summary to stderr\n"
+            "      --bench[=MB]  run the throughput benchmarks on generated corpora\n"
+            "                    (default 16 MB each) instead of disassembling\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    static char out_buf[1 << 20];
+    static const struct option long_options[] = {
+        {"threads", required_argument, NULL, 'j'},
+        {"raw",     no_argument,       NULL, 'r'},
+        {"boundaries", no_argument,    NULL, 'b'},
+        {"bench",   optional_argument, NULL, 'B'},
+        {"recursive", no_argument,     NULL, 'R'},
+        {"entry",   required_argument, NULL, 'e'},
+        {"cfg",     no_argument,       NULL, 'c'},
+        {"base",    required_argument, NULL, 'a'},
+        {"build-index", required_argument, NULL, 'I'},
+        {"index-interval", required_argument, NULL, 'K'},
+        {"index",   required_argument, NULL, 'x'},
+        {"start",   required_argument, NULL, 's'},
+        {"end",     required_argument, NULL, 'E'},
+        {"count",   required_argument, NULL, 'n'},
+        {"format",  required_argument, NULL, 'f'},
+        {"columns", required_argument, NULL, 'C'},
+        {"profile", no_argument,       NULL, 'P'},
+        {"pipeline", optional_argument, NULL, 'p'},
+        {"batch",   required_argument, NULL, 'L'},
+        {"out-dir", required_argument, NULL, 'O'},
+        {"io-uring", no_argument,      NULL, 'U'},
+        {NULL, 0, NULL, 0}
+    };
+    struct profile profile;
+    struct cli_options opts = { .threads = 1, .index_interval = DISFORGE_INDEX_DEFAULT_INTERVAL,
+                                .end = SIZE_MAX, .count = SIZE_MAX };
+    struct disforge_sink out;
+    const char *batch = NULL, *out_dir = NULL;
+    int threads_set = 0, io_uring = 0, start_set = 0;
+    char *end;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'j':
+                opts.threads = (int) strtol(optarg, &end, 10);
+                if (*end != '\0' || opts.threads < 0) {
+                    fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                if (opts.threads == 0)
+                    opts.threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+                threads_set = 1;
+                break;
+            case 'r':
+                opts.raw = 1;
+                break;
+            case 'b':
+                opts.boundaries = 1;
+                break;
+            case 'R':
+                opts.recursive = 1;
+                break;
+            case 'c':
+                opts.cfg = opts.recursive = 1;
+                break;
+            case 'a':
+                errno = 0;
+                opts.base = (size_t) strtoull(optarg, &end, 0);
+                if (*optarg == '\0' || *end != '\0' || errno != 0 || opts.base > UINT32_MAX) {
+                    fprintf(stderr, "Invalid base address: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'e': {
+                size_t *grown = realloc(opts.entries, (opts.nentries + 1) * sizeof(*grown));
+                if (!grown) {
+                    perror("Error allocating entry points");
+                    return EXIT_FAILURE;
+                }
+                opts.entries = grown;
+                errno = 0;
+                opts.entries[opts.nentries++] = (size_t) strtoull(optarg, &end, 0);
+                if (*optarg == '\0' || *end != '\0' || errno != 0) {
+                    fprintf(stderr, "Invalid entry address: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                opts.recursive = 1;
+                break;
+            }
+            case 'I':
+                opts.build_index = optarg;
+                break;
+            case 'K': {
+                unsigned long k = strtoul(optarg, &end, 10);
+                if (*end != '\0' || k == 0 || k > UINT32_MAX) {
+                    fprintf(stderr, "Invalid index interval: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                opts.index_interval = (uint32_t) k;
+                break;
+            }
+            case 'x':
+                opts.index = optarg;
+                break;
+            case 'C':
+                opts.columns = optarg;
+                break;
+            case 'P':
+                opts.profile = &profile;
+                break;
+            case 'p': {
+                long n = optarg ? strtol(optarg, &end, 10) : sysconf(_SC_NPROCESSORS_ONLN) - 2;
+                if (optarg && (*end != '\0' || n < 1)) {
+                    fprintf(stderr, "Invalid formatter thread count: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                opts.pipeline = n > 1 ? (int) n : 1;
+                break;
+            }
+            case 'L':
+                batch = optarg;
+                break;
+            case 'O':
+                out_dir = optarg;
+                break;
+            case 'U':
+                io_uring = 1;
+                break;
+            case 'f':
+                if (strcmp(optarg, "text") == 0) {
+                    opts.format = DISFORGE_TEXT;
+                } else if (strcmp(optarg, "bin") == 0) {
+                    opts.format = DISFORGE_RECORDS;
+                } else {
+                    fprintf(stderr, "Unknown output format: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+            case 'E':
+            case 'n': {
+                errno = 0;
+                size_t v = (size_t) strtoull(optarg, &end, 0);
+                if (*optarg == '\0' || *end != '\0' || errno != 0 || (c == 'n' && v == 0)) {
+                    fprintf(stderr, "Invalid %s: %s\n",
+                            c == 's' ? "start address" : c == 'E' ? "end address" : "count", optarg);
+                    return EXIT_FAILURE;
+                }
+                if (c == 's') {
+                    opts.start = v;
+                    start_set = 1;
+                } else if (c == 'E') {
+                    opts.end = v;
+                } else {
+                    opts.count = v;
+                }
+                opts.range = 1;
+                break;
+            }
+            case 'B':
+                opts.bench_mb = optarg ? strtol(optarg, &end, 10) : 16;
+                if ((optarg && *end != '\0') || opts.bench_mb <= 0) {
+                    fprintf(stderr, "Invalid benchmark size: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind > 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+#ifdef DISFORGE_STATS
+    atexit(disforge_stats_report);
+#endif
+    if (opts.pipeline && opts.threads > 1) {
+        fprintf(stderr, "--pipeline and -j are alternatives\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.format == DISFORGE_RECORDS && opts.cfg) {
+        fprintf(stderr, "--cfg has no binary format\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.range && (opts.recursive || opts.profile)) {
+        fprintf(stderr, "Range options list a linear sweep of part of the file; "
+                "--recursive, --cfg, --entry and --profile need the whole file\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.profile && (opts.boundaries || opts.threads > 1 || opts.pipeline || opts.recursive ||
+                         opts.build_index || opts.columns || opts.bench_mb > 0 ||
+                         (optind < argc && strcmp(argv[optind], "-") == 0))) {
+        fprintf(stderr, "--profile times a serial linear listing of a file; it cannot be "
+                "combined with standard input, --boundaries, -j, --pipeline, --recursive, "
+                "--cfg, --entry, --build-index, --columns or --bench\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.range && !start_set)
+        opts.start = opts.base;
+    if (opts.range && opts.end <= opts.start) {
+        fprintf(stderr, "--end 0x%zx is not above --start 0x%zx\n", opts.end, opts.start);
+        return EXIT_FAILURE;
+    }
+    if (opts.nentries > 0 && !(opts.entry_listed = calloc(opts.nentries, 1))) {
+        perror("Error allocating entry points");
+        return EXIT_FAILURE;
+    }
+
+    if (io_uring && !batch) {
+        disforge_sink_init_async(&out, STDOUT_FILENO, out_buf, sizeof(out_buf));
+        report_no_uring(&out);
+    } else {
+        disforge_sink_init(&out, STDOUT_FILENO, out_buf, sizeof(out_buf));
+    }
+    out.format = opts.format;
+    if (opts.profile)
+        profile_init(opts.profile);
+    if (opts.bench_mb > 0)
+        return finish_output(&out, run_benchmarks(&out, (size_t) opts.bench_mb << 20));
+    if (batch) {
+        if (!out_dir || optind < argc || opts.build_index || opts.columns || opts.index ||
+            opts.profile) {
+            fprintf(stderr, "--batch needs --out-dir and no file argument; --build-index, "
+                    "--columns, --index and --profile need a single file\n");
+            return EXIT_FAILURE;
+        }
+        return run_batch(batch, out_dir,
+                         threads_set ? opts.threads : (int) sysconf(_SC_NPROCESSORS_ONLN),
+                         io_uring, &opts);
+    }
+    if (optind < argc && strcmp(argv[optind], "-") == 0) {
+        if (opts.boundaries || opts.threads > 1 || opts.pipeline || opts.recursive ||
+            opts.build_index || opts.columns || opts.range) {
+            fprintf(stderr, "Standard input is listed sequentially; --boundaries, -j, "
+                    "--pipeline, --recursive, --build-index, --columns and range options "
+                    "need a file\n");
+            return EXIT_FAILURE;
+        }
+        disforge_list_header(&out, "Disassembled code from standard input", NULL);
+        return finish_output(&out, disassemble_fd_stream(&out, STDIN_FILENO, opts.base));
+    }
+    if (optind < argc)
+        return finish_output(&out, disassemble_file(&out, argv[optind], &opts));
+
+    // Example machine code containing a variety of instructions.
+    uint8_t code[] = {
+        0x90,                               // NOP
+        0xB8, 0x78, 0x56, 0x34, 0x12,         // MOV EAX, 0x12345678
+        0xB9, 0xEF, 0xCD, 0xAB, 0x90,         // MOV ECX, 0x90ABCDEF
+        0x03, 0xC1,                         // ADD EAX, ECX   (ModR/M: both operands registers)
+        0x83, 0xE8, 0x05,                   // SUB EAX, 5     (immediate arithmetic)
+        0x89, 0xC3,                         // MOV EBX, EAX
+        0x01, 0xCB,                         // ADD EBX, ECX
+        0x29, 0xC3,                         // SUB EBX, EAX
+        0xF7, 0xE3,                         // MUL EBX       (F7 /4)
+        0xE8, 0x12, 0x34, 0x56, 0x78,         // CALL 0x78563412
+        0x74, 0x05,                         // JE +5
+        0xE9, 0x78, 0x56, 0x34, 0x12,         // JMP 0x12345678
+        0xFF, 0xC0,                         // INC EAX       (FF /0)
+        0xFF, 0xC8,                         // DEC EAX       (FF /1)
+        0x0F, 0xB6, 0xC0,                   // MOVZX EAX, AL
+        0x0F, 0xBE, 0xC0,                   // MOVSX EAX, AL
+        0xF3, 0xA4,                         // REP MOVSB
+        0x86, 0xC1,                         // XCHG AL, CL
+        0xD1, 0xE0,                         // SHL EAX, 1
+        0xE2, 0xFE,                         // LOOP -2
+        0xC3                                // RET
+    };
+    size_t code_size = sizeof(code) / sizeof(code[0]);
+    
+    disforge_list_header(&out, "Disassembled code", NULL);
+    disforge_disassemble(&out, code, code_size, 0);
+
+    return finish_output(&out, EXIT_SUCCESS);
+}
\ No newline at end of file